@@ -0,0 +1,25 @@
+# embeds every shader in SHADER_DIR into OUTPUT as a NUL terminated char array
+# named after its file, shader.vert becomes shader_vert
+# run as: cmake -DSHADER_DIR=<dir> -DOUTPUT=<header> -P EmbedShaders.cmake
+file(GLOB SHADER_FILES ${SHADER_DIR}/*.vert ${SHADER_DIR}/*.frag)
+list(SORT SHADER_FILES)
+
+set(CONTENT "/* generated by cmake/EmbedShaders.cmake, do not edit */\n\n")
+set(CONTENT "${CONTENT}#ifndef EMBEDDED_SHADERS_H\n#define EMBEDDED_SHADERS_H\n\n")
+foreach(SHADER_FILE ${SHADER_FILES})
+    get_filename_component(NAME ${SHADER_FILE} NAME)
+    string(REPLACE "." "_" NAME ${NAME})
+    # read as hex so quotes, backslashes and line endings need no escaping
+    file(READ ${SHADER_FILE} HEX HEX)
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," BYTES "${HEX}")
+    set(CONTENT "${CONTENT}static const char ${NAME}[] = {\n${BYTES}0x00\n};\n\n")
+endforeach()
+set(CONTENT "${CONTENT}#endif\n")
+
+# only touch the header when a shader changed, saves rebuilding GFXscreen.c
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} OLD_CONTENT)
+endif()
+if(NOT "${OLD_CONTENT}" STREQUAL "${CONTENT}")
+    file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
@@ -1,6 +1,8 @@
 #include "Chip8.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,104 +12,386 @@
 #define FNAME "Chip8.c"
 
 
-#define MEMORY_SZ 0xFFF
+#define MEMORY_SZ 0x1000
 #define V_SZ 0x10
 #define GFX_SZ CHIP8_DISPLAY_WIDTH * CHIP8_DISPLAY_HEIGHT
 #define STACK_SZ 0x10
-
-
+#define TIMER_HZ 60
+#define CACHE_LINE_SZ 64
+#define ALL_ROWS 0xFFFFFFFFu
+// keypad keys are bits of a uint16_t, V[x] selects one by its low nibble
+#define KEYPAD_SZ 16
+#define KEY_BIT(key) (1u << ((key) & (KEYPAD_SZ - 1)))
+
+// snapshot layout, all multi-byte fields little endian:
+//	magic, version, memory, V, I, pc, stack, sp, delay timer, sound timer,
+//	timer accumulator, execution blocked, key register, PRNG, cycles, rows
+#define SNAPSHOT_MAGIC "C8SS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SZ (4 + 1 + MEMORY_SZ + V_SZ + 2 + 2 + STACK_SZ * 2 + 1 + 1 \
+	+ 1 + 4 + 1 + 1 + 4 + 8 + CHIP8_DISPLAY_HEIGHT * 8)
+// fields checked before a snapshot is restored, they index machine arrays
+#define SNAPSHOT_SP_OFFSET (4 + 1 + MEMORY_SZ + V_SZ + 2 + 2 + STACK_SZ * 2)
+#define SNAPSHOT_BLOCKED_OFFSET (SNAPSHOT_SP_OFFSET + 1 + 1 + 1 + 4)
+#define SNAPSHOT_KEY_REGISTER_OFFSET (SNAPSHOT_BLOCKED_OFFSET + 1)
+
+
+/*
+ * opcode dispatch engine, selected at build time (see CMakeLists.txt), all of
+ * them run inside the chip8_run_cycles loop:
+ *	CHIP8_DISPATCH_SWITCH - the original nested switch on the raw opcode
+ *	CHIP8_DISPATCH_TABLE  - 64K handler id table, handlers called by pointer
+ *	CHIP8_DISPATCH_GOTO   - same table, threaded code, every handler label
+ *	                        ends in its own fetch and computed goto (GCC/Clang)
+ */
+#if !defined(CHIP8_DISPATCH_SWITCH) && !defined(CHIP8_DISPATCH_TABLE) \
+	&& !defined(CHIP8_DISPATCH_GOTO)
+	#if defined(__GNUC__)
+		#define CHIP8_DISPATCH_GOTO
+	#else
+		#define CHIP8_DISPATCH_TABLE
+	#endif
+#endif
+#if defined(CHIP8_DISPATCH_GOTO) && !defined(__GNUC__)
+	#undef CHIP8_DISPATCH_GOTO
+	#define CHIP8_DISPATCH_TABLE
+#endif
+
+// handlers and the fetch go into the run loop so its locals stay in registers
+#if defined(__GNUC__)
+	#define ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+	#define ALWAYS_INLINE __forceinline
+#else
+	#define ALWAYS_INLINE inline
+#endif
+
+// handler id, handler name suffix
+#define OPCODE_LIST(OP) \
+	OP(UNKNOWN, unknown) \
+	OP(00E0, 00e0) OP(00EE, 00ee) OP(1NNN, 1nnn) OP(2NNN, 2nnn) \
+	OP(3XNN, 3xnn) OP(4XKK, 4xkk) OP(5XY0, 5xy0) OP(6XKK, 6xkk) \
+	OP(7XNN, 7xnn) OP(8XY0, 8xy0) OP(8XY1, 8xy1) OP(8XY2, 8xy2) \
+	OP(8XY3, 8xy3) OP(8XY4, 8xy4) OP(8XY5, 8xy5) OP(8XY6, 8xy6) \
+	OP(8XY7, 8xy7) OP(8XYE, 8xye) OP(9XY0, 9xy0) OP(ANNN, annn) \
+	OP(BNNN, bnnn) OP(CXNN, cxnn) OP(DXYN, dxyn) OP(EX9E, ex9e) \
+	OP(EXA1, exa1) OP(FX07, fx07) OP(FX0A, fx0a) OP(FX15, fx15) \
+	OP(FX18, fx18) OP(FX1E, fx1e) OP(FX29, fx29) OP(FX33, fx33) \
+	OP(FX55, fx55) OP(FX65, fx65)
+
+
+struct Instruction;
+struct Registers;
+
+static void init_module(void);
+static void *align_cache_line(void *ptr);
+static void configure_chip8(Chip8 c8);
 static void initialize_chip8(Chip8 c8);
 static void load_fontset(Chip8 c8);
 
-static void update_timers(Chip8 c8, unsigned hz);
+static void tick_timers(Chip8 c8, unsigned long ticks);
+static void step_timers(Chip8 c8);
+static void update_wallclock_timers(Chip8 c8);
+static void idle_cycles(Chip8 c8, unsigned long n);
+
+static unsigned char decode_opcode(unsigned short oc);
+static void build_opcode_table(void);
+static ALWAYS_INLINE unsigned short read_opcode(const Chip8 c8,
+	unsigned short addr);
+static ALWAYS_INLINE void decode_instruction(unsigned short oc,
+	struct Instruction *ins);
+static void decode_slot(Chip8 c8, unsigned short pc);
+static ALWAYS_INLINE const struct Instruction* fetch_instruction(Chip8 c8,
+	unsigned short pc, struct Instruction *fetched);
+static void invalidate_decoded(Chip8 c8, unsigned short addr, size_t len);
+static void poll_keypad(Chip8 c8);
+static unsigned lowest_key(uint16_t keys);
+static uint16_t map_to_keypad(const Map keypad_state_map);
+static void mark_rows_changed(Chip8 c8, uint32_t rows);
+static unsigned char* put_le(unsigned char *buf, uint64_t value, size_t sz);
+static uint64_t get_le(const unsigned char **buf, size_t sz);
+static void restore_memory(Chip8 c8, const unsigned char *memory);
+static void restore_rows(Chip8 c8, const uint64_t *rows);
+static unsigned char random_byte(Chip8 c8);
 
 static unsigned short NNN(unsigned short oc);
 static unsigned char kk(unsigned short oc);
 static unsigned char N(unsigned short oc);
 static unsigned char X(unsigned short oc);
 static unsigned char Y(unsigned short oc);
-static void opcode_00e0(Chip8 c8);
-static void opcode_00ee(Chip8 c8);
-static void opcode_1nnn(Chip8 c8);
-static void opcode_2nnn(Chip8 c8);
-static void opcode_3xnn(Chip8 c8);
-static void opcode_4xkk(Chip8 c8);
-static void opcode_5xy0(Chip8 c8);
-static void opcode_6xkk(Chip8 c8);
-static void opcode_7xnn(Chip8 c8);
-static void opcode_8xy0(Chip8 c8);
-static void opcode_8xy1(Chip8 c8);
-static void opcode_8xy2(Chip8 c8);
-static void opcode_8xy3(Chip8 c8);
-static void opcode_8xy4(Chip8 c8);
-static void opcode_8xy5(Chip8 c8);
-static void opcode_8xy6(Chip8 c8);
-static void opcode_8xy7(Chip8 c8);
-static void opcode_8xye(Chip8 c8);
-static void opcode_9xy0(Chip8 c8);
-static void opcode_annn(Chip8 c8);
-static void opcode_bnnn(Chip8 c8);
-static void opcode_cxnn(Chip8 c8);
-static void opcode_dxyn(Chip8 c8);
-static void opcode_ex9e(Chip8 c8, Map keypad_state_map);
-static void opcode_exa1(Chip8 c8, Map keypad_state_map);
-static void opcode_fx07(Chip8 c8);
-static void opcode_fx0a(Chip8 c8, Map keypad_state_map);
-static void opcode_fx15(Chip8 c8);
-static void opcode_fx18(Chip8 c8);
-static void opcode_fx1e(Chip8 c8);
-static void opcode_fx29(Chip8 c8);
-static void opcode_fx33(Chip8 c8);
-static void opcode_fx55(Chip8 c8);
-static void opcode_fx65(Chip8 c8);
-
-
-static bool instance_exists;
+static void opcode_unknown(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_00e0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_00ee(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_1nnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_2nnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_3xnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_4xkk(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_5xy0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_6xkk(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_7xnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy1(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy2(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy3(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy4(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy5(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy6(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xy7(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_8xye(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_9xy0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_annn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_bnnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_cxnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_dxyn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_ex9e(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_exa1(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx07(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx0a(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx15(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx18(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx1e(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx29(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx33(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx55(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+static ALWAYS_INLINE void opcode_fx65(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+
+
+#define OPCODE_ENUM(id, name) OP_##id,
+enum { OPCODE_LIST(OPCODE_ENUM) OP_COUNT };
+#undef OPCODE_ENUM
+
+typedef void (*Opcode_handler)(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins);
+
+
+// instances created so far, mixed into the default seed of each one
+static unsigned long instance_count;
+
+// handler id of every raw opcode, filled once by build_opcode_table
+static unsigned char opcode_table[0x10000];
+
+#if defined(CHIP8_DISPATCH_TABLE)
+#define OPCODE_HANDLER(id, name) opcode_##name,
+static const Opcode_handler opcode_handlers[OP_COUNT] = {
+	OPCODE_LIST(OPCODE_HANDLER)
+};
+#undef OPCODE_HANDLER
+#endif
+
+
+// opcode with its operands extracted, one per address in the decoded cache
+struct Instruction {
+	unsigned char op;
+	unsigned char x;
+	unsigned char y;
+	unsigned char n;
+	unsigned char kk;
+	bool decoded;
+	unsigned short nnn;
+	unsigned short oc;		// raw opcode, what the switch engine decodes
+};
 
+// registers chip8_run_cycles keeps in locals, written back when it returns
+struct Registers {
+	unsigned short pc;
+	unsigned short I;
+};
 
 struct Chip8_t {
-	unsigned short opcode;
+	// machine state, snapshots cover every field up to dirty_rows
 	unsigned char memory[MEMORY_SZ];
+	uint64_t gfx_rows[CHIP8_DISPLAY_HEIGHT];
 	unsigned char V[V_SZ];
 	unsigned short I;
 	unsigned short pc;
-	unsigned char gfx[GFX_SZ];
-	unsigned char delay_timer;
-	unsigned char sound_timer;
-	float prev_tick_time;
 	unsigned short stack[STACK_SZ];
 	unsigned short sp;
+	unsigned char delay_timer;
+	unsigned char sound_timer;
+	unsigned timer_acc;
 	bool execution_blocked;
+	unsigned char key_register;
+	uint32_t rng;
+	unsigned long long cycles;
+
+	// derived from the machine state
+	uint32_t dirty_rows;
+	uint32_t stale_rows;
+	unsigned long long gfx_version;
+	unsigned char gfx[GFX_SZ];
+	struct Instruction decoded[MEMORY_SZ];
+	unsigned long long instructions;	// executed since loading, not idled
+
+	// configuration and ownership
+	Chip8_interpreter interpreter;
+	Chip8_timers timers;
+	unsigned ips;
+	double timer_time;
+	uint16_t keys;			// held during the current chip8_run_cycles
+	uint16_t keys_pressed;	// pressed passed to chip8_run_cycles, not consumed
+	Chip8_pool pool;
+	void *allocation;
+};
+
+#define STATE_SZ offsetof(struct Chip8_t, dirty_rows)
+// registers, stack, timers, PRNG and cycle count, everything after gfx_rows
+#define REGISTERS_OFFSET offsetof(struct Chip8_t, V)
+#define REGISTERS_SZ (STATE_SZ - REGISTERS_OFFSET)
+
+// aligned copy of the machine state for chip8_state_save/chip8_state_load
+struct Chip8_state_t {
+	unsigned char data[STATE_SZ];
+	void *allocation;
+};
+
+// fixed number of instance slots carved out of one contiguous arena
+struct Chip8_pool_t {
+	void *arena;
+	unsigned char *slots;
+	size_t slot_sz;
+	size_t capacity;
+	size_t free_count;
+	size_t *free_slots;
 };
 
 
 Chip8 chip8_create(void)
 {
-	if (instance_exists)
-		exit_log(FNAME, 1,
-			"Failed creating Chip8, only one instance permitted.");
+	init_module();
 
-	Chip8 c8 = (Chip8) malloc(sizeof(struct Chip8_t));
-	if (!c8)
+	void *allocation = malloc(sizeof(struct Chip8_t) + CACHE_LINE_SZ - 1);
+	if (!allocation)
 		exit_log(FNAME, 1, "Failed creating Chip8, memory allocation fail.");
 
-	static bool rand_seeded;
-	if (!rand_seeded) {
-		srand((unsigned int)time(NULL));
-		rand_seeded = true;
-	}
+	Chip8 c8 = (Chip8)align_cache_line(allocation);
+	configure_chip8(c8);
+	c8->allocation = allocation;
+	initialize_chip8(c8);
+	return c8;
+}
+
+Chip8_pool chip8_pool_create(size_t capacity)
+{
+	init_module();
+
+	Chip8_pool pool = (Chip8_pool)malloc(sizeof(struct Chip8_pool_t));
+	if (!pool)
+		exit_log(FNAME, 1,
+			"Failed creating Chip8 pool, memory allocation fail.");
+
+	// round slots up to whole cache lines so no two instances share one
+	pool->slot_sz = (sizeof(struct Chip8_t) + CACHE_LINE_SZ - 1)
+		/ CACHE_LINE_SZ * CACHE_LINE_SZ;
+	pool->capacity = capacity;
+	pool->arena = malloc(pool->slot_sz * capacity + CACHE_LINE_SZ - 1);
+	pool->free_slots = (size_t*)malloc(sizeof(size_t) * capacity);
+	if (!pool->arena || !pool->free_slots)
+		exit_log(FNAME, 1,
+			"Failed creating Chip8 pool, memory allocation fail.");
+	pool->slots = (unsigned char*)align_cache_line(pool->arena);
+
+	// hand out low slots first so a partly used pool stays dense
+	pool->free_count = capacity;
+	for (size_t i = 0; i < capacity; ++i)
+		pool->free_slots[i] = capacity - 1 - i;
+
+	return pool;
+}
+
+Chip8 chip8_pool_acquire(Chip8_pool pool)
+{
+	if (!pool->free_count)
+		exit_log(FNAME, 1, "Failed acquiring Chip8, pool exhausted.");
 
+	size_t slot = pool->free_slots[--pool->free_count];
+	Chip8 c8 = (Chip8)(pool->slots + slot * pool->slot_sz);
+	configure_chip8(c8);
+	c8->pool = pool;
 	initialize_chip8(c8);
-	instance_exists = true;
 	return c8;
 }
 
-static void initialize_chip8(Chip8 c8)
+void chip8_pool_destroy(Chip8_pool pool)
+{
+	free(pool->free_slots);
+	free(pool->arena);
+	free(pool);
+}
+
+// set up state shared by every instance, once per process
+static void init_module(void)
+{
+	static bool opcode_table_built;
+	if (!opcode_table_built) {
+		build_opcode_table();
+		opcode_table_built = true;
+	}
+}
+
+static void *align_cache_line(void *ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+	addr = (addr + CACHE_LINE_SZ - 1) & ~(uintptr_t)(CACHE_LINE_SZ - 1);
+	return (void*)addr;
+}
+
+// default configuration and a seed unique to this instance
+static void configure_chip8(Chip8 c8)
 {
 	memset(c8, 0, sizeof(struct Chip8_t));
+	c8->interpreter = CHIP8_INTERPRETER_PLAIN;
+	c8->timers = CHIP8_TIMERS_CYCLES;
+	c8->ips = CHIP8_DEFAULT_IPS;
+	chip8_seed(c8, (unsigned long)time(NULL) ^ ++instance_count * 0x9E3779B9UL);
+}
+
+static void initialize_chip8(Chip8 c8)
+{
+	// the PRNG stream survives reloading a program
+	uint32_t rng = c8->rng;
+	memset(c8, 0, STATE_SZ);
+	c8->rng = rng;
 	c8->pc = 0x200;
+	c8->instructions = 0;
+	c8->timer_time = get_time();
+	invalidate_decoded(c8, 0, MEMORY_SZ);
+	mark_rows_changed(c8, ALL_ROWS);
 	load_fontset(c8);
-	c8->execution_blocked = false;
 }
 
 static void load_fontset(Chip8 c8)
@@ -145,206 +429,559 @@ void chip8_load_program(Chip8 c8, const char *file_path)
 	fclose(f);
 }
 
+// byte per pixel copy of the display, rows are expanded only after they change
 const unsigned char* chip8_get_gfx(const Chip8 c8)
 {
+	for (size_t i = 0; c8->stale_rows; ++i) {
+		if (!(c8->stale_rows & 1u << i))
+			continue;
+
+		uint64_t row = c8->gfx_rows[i];
+		unsigned char *pixel = c8->gfx + i * CHIP8_DISPLAY_WIDTH;
+		for (size_t j = 0; j < CHIP8_DISPLAY_WIDTH; ++j)
+			pixel[j] = row >> (CHIP8_DISPLAY_WIDTH - 1 - j) & 1;
+		c8->stale_rows &= ~(1u << i);
+	}
 	return c8->gfx;
 }
 
-void chip8_execute_opcode(Chip8 c8, const Map keypad_state_map)
+const uint64_t* chip8_get_gfx_rows(const Chip8 c8)
 {
-	if (!c8->memory[0x200] && !c8->memory[0x201])
-		exit_log(FNAME, 1, "Failed executing opcode, no program loaded.");
+	return c8->gfx_rows;
+}
 
-	if (c8->execution_blocked) {
-		opcode_fx0a(c8, keypad_state_map);
-		return;
-	}
+// incremented every time an opcode changes at least one pixel
+unsigned long long chip8_get_gfx_version(const Chip8 c8)
+{
+	return c8->gfx_version;
+}
 
-	update_timers(c8, 60);
-	c8->opcode = c8->memory[c8->pc] << 8 | c8->memory[c8->pc + 1];
-	switch (c8->opcode & 0xF000) {
-	case 0x0000:
-		switch (c8->opcode & 0x000F) {
-		case 0x0000:
-			opcode_00e0(c8);
-			break;
+// bit i is set when row i changed since chip8_clear_dirty_rows
+uint32_t chip8_get_dirty_rows(const Chip8 c8)
+{
+	return c8->dirty_rows;
+}
 
-		case 0x000E:
-			opcode_00ee(c8);
-			break;
+void chip8_clear_dirty_rows(Chip8 c8)
+{
+	c8->dirty_rows = 0;
+}
 
-		default:
-			goto UNKNOWN_OPCODE;
-		}
-		break;
+size_t chip8_snapshot_size(void)
+{
+	return SNAPSHOT_SZ;
+}
 
-	case 0x1000:
-		opcode_1nnn(c8);
-		break;
+// serialize the machine state into buf, chip8_snapshot_size bytes long
+size_t chip8_snapshot(const Chip8 c8, unsigned char *buf)
+{
+	unsigned char *iter = buf;
+	memcpy(iter, SNAPSHOT_MAGIC, 4);
+	iter += 4;
+	*iter++ = SNAPSHOT_VERSION;
+	memcpy(iter, c8->memory, MEMORY_SZ);
+	iter += MEMORY_SZ;
+	memcpy(iter, c8->V, V_SZ);
+	iter += V_SZ;
+	iter = put_le(iter, c8->I, 2);
+	iter = put_le(iter, c8->pc, 2);
+	for (size_t i = 0; i < STACK_SZ; ++i)
+		iter = put_le(iter, c8->stack[i], 2);
+	*iter++ = (unsigned char)c8->sp;
+	*iter++ = c8->delay_timer;
+	*iter++ = c8->sound_timer;
+	iter = put_le(iter, c8->timer_acc, 4);
+	*iter++ = c8->execution_blocked;
+	*iter++ = c8->key_register;
+	iter = put_le(iter, c8->rng, 4);
+	iter = put_le(iter, c8->cycles, 8);
+	for (size_t i = 0; i < CHIP8_DISPLAY_HEIGHT; ++i)
+		iter = put_le(iter, c8->gfx_rows[i], 8);
+
+	return iter - buf;
+}
 
-	case 0x2000:
-		opcode_2nnn(c8);
-		break;
+void chip8_restore(Chip8 c8, const unsigned char *buf, size_t sz)
+{
+	if (sz < SNAPSHOT_SZ || memcmp(buf, SNAPSHOT_MAGIC, 4))
+		exit_log(FNAME, 1, "Failed restoring snapshot, not a Chip8 snapshot.");
+	if (buf[4] != SNAPSHOT_VERSION)
+		exit_log(FNAME, 1, "Failed restoring snapshot, unsupported version.");
+	if (buf[SNAPSHOT_SP_OFFSET] > STACK_SZ
+		|| buf[SNAPSHOT_BLOCKED_OFFSET] > 1
+		|| buf[SNAPSHOT_KEY_REGISTER_OFFSET] >= V_SZ)
+		exit_log(FNAME, 1, "Failed restoring snapshot, corrupt registers.");
+
+	const unsigned char *iter = buf + 5;
+	restore_memory(c8, iter);
+	iter += MEMORY_SZ;
+	memcpy(c8->V, iter, V_SZ);
+	iter += V_SZ;
+	c8->I = (unsigned short)get_le(&iter, 2);
+	c8->pc = (unsigned short)get_le(&iter, 2);
+	for (size_t i = 0; i < STACK_SZ; ++i)
+		c8->stack[i] = (unsigned short)get_le(&iter, 2);
+	c8->sp = *iter++;
+	c8->delay_timer = *iter++;
+	c8->sound_timer = *iter++;
+	c8->timer_acc = (unsigned)get_le(&iter, 4);
+	c8->execution_blocked = *iter++;
+	c8->key_register = *iter++;
+	c8->rng = (uint32_t)get_le(&iter, 4);
+	c8->cycles = get_le(&iter, 8);
+
+	uint64_t rows[CHIP8_DISPLAY_HEIGHT];
+	for (size_t i = 0; i < CHIP8_DISPLAY_HEIGHT; ++i)
+		rows[i] = get_le(&iter, 8);
+	restore_rows(c8, rows);
+}
 
-	case 0x3000:
-		opcode_3xnn(c8);
-		break;
+Chip8_state chip8_state_create(void)
+{
+	void *allocation = malloc(sizeof(struct Chip8_state_t) + CACHE_LINE_SZ - 1);
+	if (!allocation)
+		exit_log(FNAME, 1,
+			"Failed creating Chip8 state, memory allocation fail.");
 
-	case 0x4000:
-		opcode_4xkk(c8);
-		break;
+	Chip8_state state = (Chip8_state)align_cache_line(allocation);
+	state->allocation = allocation;
+	return state;
+}
 
-	case 0x5000:
-		opcode_5xy0(c8);
-		break;
+// in-memory snapshot, a straight copy of the machine state fields
+void chip8_state_save(const Chip8 c8, Chip8_state state)
+{
+	memcpy(state->data, c8, STATE_SZ);
+}
 
-	case 0x6000:
-		opcode_6xkk(c8);
-		break;
+void chip8_state_load(Chip8 c8, const Chip8_state state)
+{
+	restore_memory(c8, state->data);
+	restore_rows(c8,
+		(const uint64_t*)(state->data + offsetof(struct Chip8_t, gfx_rows)));
+	memcpy((unsigned char*)c8 + REGISTERS_OFFSET,
+		state->data + REGISTERS_OFFSET, REGISTERS_SZ);
+}
 
-	case 0x7000:
-		opcode_7xnn(c8);
-		break;
+void chip8_state_destroy(Chip8_state state)
+{
+	free(state->allocation);
+}
 
-	case 0x8000:
-		switch (c8->opcode & 0x000F) {
-		case 0x0000:
-			opcode_8xy0(c8);
-			break;
-		case 0x0001:
-			opcode_8xy1(c8);
-			break;
+static unsigned char* put_le(unsigned char *buf, uint64_t value, size_t sz)
+{
+	for (size_t i = 0; i < sz; ++i)
+		*buf++ = (unsigned char)(value >> i * 8);
+	return buf;
+}
 
-		case 0x0002:
-			opcode_8xy2(c8);
-			break;
-		case 0x0003:
-			opcode_8xy3(c8);
-			break;
-		case 0x0004:
-			opcode_8xy4(c8);
-			break;
+static uint64_t get_le(const unsigned char **buf, size_t sz)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < sz; ++i)
+		value |= (uint64_t)*(*buf)++ << i * 8;
+	return value;
+}
 
-		case 0x0005:
-			opcode_8xy5(c8);
-			break;
-		case 0x0006:
-			opcode_8xy6(c8);
-			break;
-		case 0x0007:
-			opcode_8xy7(c8);
-			break;
-		case 0x000e:
-			opcode_8xye(c8);
-			break;
+/*
+ * copies memory a cache line at a time, only lines that differ are written
+ * and have their decoded slots dropped so the cache mostly survives restores
+ */
+static void restore_memory(Chip8 c8, const unsigned char *memory)
+{
+	for (size_t addr = 0; addr < MEMORY_SZ; addr += CACHE_LINE_SZ)
+		if (memcmp(c8->memory + addr, memory + addr, CACHE_LINE_SZ)) {
+			memcpy(c8->memory + addr, memory + addr, CACHE_LINE_SZ);
+			invalidate_decoded(c8, (unsigned short)addr, CACHE_LINE_SZ);
+		}
+}
 
-		default:
-			goto UNKNOWN_OPCODE;
+static void restore_rows(Chip8 c8, const uint64_t *rows)
+{
+	uint32_t changed_rows = 0;
+	for (size_t i = 0; i < CHIP8_DISPLAY_HEIGHT; ++i)
+		if (c8->gfx_rows[i] != rows[i]) {
+			c8->gfx_rows[i] = rows[i];
+			changed_rows |= 1u << i;
 		}
-		break;
-	case 0x9000:
-		opcode_9xy0(c8);
-		break;
-	case 0xA000:
-		opcode_annn(c8);
-		break;
-	case 0xB000:
-		opcode_bnnn(c8);
-		break;
-	case 0xC000:
-		opcode_cxnn(c8);
-		break;
+	mark_rows_changed(c8, changed_rows);
+}
 
-	case 0xD000:
-		opcode_dxyn(c8);
-		break;
+void chip8_set_interpreter(Chip8 c8, Chip8_interpreter interpreter)
+{
+	c8->interpreter = interpreter;
+	invalidate_decoded(c8, 0, MEMORY_SZ);
+}
 
-	case 0xE000:
-		switch (c8->opcode & 0x00FF) {
-		case 0x009E:
-			opcode_ex9e(c8, keypad_state_map);
-			break;
+void chip8_seed(Chip8 c8, unsigned long seed)
+{
+	// splitmix64 finalizer, nearby seeds give unrelated streams
+	uint64_t z = (uint64_t)seed + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ z >> 27) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+
+	// xorshift state must never be zero
+	c8->rng = (uint32_t)z ? (uint32_t)z : 0x2545F491;
+}
 
-		case 0x00A1:
-			opcode_exa1(c8, keypad_state_map);
-			break;
+void chip8_set_timers(Chip8 c8, Chip8_timers timers, unsigned ips)
+{
+	if (timers == CHIP8_TIMERS_CYCLES && !ips)
+		exit_log(FNAME, 1,
+			"Failed setting timers, cycle counted timers need a rate.");
+
+	c8->timers = timers;
+	c8->ips = ips;
+	c8->timer_acc = 0;
+	c8->timer_time = get_time();
+}
+
+/*
+ * Map based adapter over chip8_run_cycles, keys that are held now but weren't
+ * at the previous call count as newly pressed
+ */
+void chip8_execute_opcode(Chip8 c8, const Map keypad_state_map)
+{
+	uint16_t keys = map_to_keypad(keypad_state_map);
+	uint16_t pressed = keys & ~c8->keys;
+	chip8_run_cycles(c8, 1, keys, &pressed);
+}
+
+/*
+ * pc and I live in locals for the whole batch, the handlers get them by
+ * pointer and, like the fetch, are inlined into the switch and goto engines
+ * so they stay in registers, V stays in the struct since handlers index it
+ * by operand
+ */
+Chip8_stop chip8_run_cycles(Chip8 c8, unsigned long n, uint16_t keys,
+	uint16_t *pressed)
+{
+	if (!c8->memory[0x200] && !c8->memory[0x201])
+		exit_log(FNAME, 1, "Failed executing opcode, no program loaded.");
 
-		default:
-			goto UNKNOWN_OPCODE;
+	c8->keys = keys;
+	c8->keys_pressed = *pressed;
+	bool count_cycles = c8->timers == CHIP8_TIMERS_CYCLES;
+	if (!count_cycles)
+		update_wallclock_timers(c8);
+
+	if (c8->execution_blocked) {
+		poll_keypad(c8);
+		if (c8->execution_blocked) {
+			idle_cycles(c8, n);
+			return CHIP8_STOP_BLOCKED;
 		}
-		break;
+		*pressed = c8->keys_pressed;
+	}
 
-	case 0xF000:
-		switch (c8->opcode & 0x00FF) {
-		case 0x0007:
-			opcode_fx07(c8);
+	struct Registers r = { c8->pc, c8->I };
+	struct Instruction fetched;
+	const struct Instruction *ins;
+	unsigned long executed = 0;
+	Chip8_stop stop = CHIP8_STOP_BUDGET;
+	if (!n)
+		goto stopped;
+
+	/*
+	 * ends the instruction that just ran, op is a constant in the switch and
+	 * goto engines so the stop checks that can't apply to it fold away
+	 */
+	#define END_INSTRUCTION(op) \
+		do { \
+			r.pc += 2; \
+			++executed; \
+			if (count_cycles) \
+				step_timers(c8); \
+			if ((op) == OP_FX0A && c8->execution_blocked) { \
+				stop = CHIP8_STOP_BLOCKED; \
+				goto stopped; \
+			} \
+			if ((op) == OP_DXYN || (op) == OP_00E0) { \
+				stop = CHIP8_STOP_DRAW; \
+				goto stopped; \
+			} \
+			if (executed == n) \
+				goto stopped; \
+		} while (0)
+
+#if defined(CHIP8_DISPATCH_GOTO)
+	#define OPCODE_LABEL(id, name) &&LABEL_##id,
+	static const void *const labels[OP_COUNT] = { OPCODE_LIST(OPCODE_LABEL) };
+	#undef OPCODE_LABEL
+
+	ins = fetch_instruction(c8, r.pc, &fetched);
+	goto *labels[ins->op];
+	#define OPCODE_BODY(id, name) \
+	LABEL_##id: \
+		opcode_##name(c8, &r, ins); \
+		END_INSTRUCTION(OP_##id); \
+		ins = fetch_instruction(c8, r.pc, &fetched); \
+		goto *labels[ins->op];
+	OPCODE_LIST(OPCODE_BODY)
+	#undef OPCODE_BODY
+#elif defined(CHIP8_DISPATCH_TABLE)
+	for (;;) {
+		ins = fetch_instruction(c8, r.pc, &fetched);
+		opcode_handlers[ins->op](c8, &r, ins);
+		END_INSTRUCTION(ins->op);
+	}
+#else
+	#define EXECUTE(id, name) \
+		opcode_##name(c8, &r, ins); \
+		END_INSTRUCTION(OP_##id); \
+		continue
+	for (;;) {
+		ins = fetch_instruction(c8, r.pc, &fetched);
+		switch (ins->oc & 0xF000) {
+		case 0x0000:
+			switch (ins->oc & 0x000F) {
+			case 0x0000: EXECUTE(00E0, 00e0);
+			case 0x000E: EXECUTE(00EE, 00ee);
+			}
 			break;
-
-		case 0x000A:
-			opcode_fx0a(c8, keypad_state_map);
+		case 0x1000: EXECUTE(1NNN, 1nnn);
+		case 0x2000: EXECUTE(2NNN, 2nnn);
+		case 0x3000: EXECUTE(3XNN, 3xnn);
+		case 0x4000: EXECUTE(4XKK, 4xkk);
+		case 0x5000: EXECUTE(5XY0, 5xy0);
+		case 0x6000: EXECUTE(6XKK, 6xkk);
+		case 0x7000: EXECUTE(7XNN, 7xnn);
+		case 0x8000:
+			switch (ins->oc & 0x000F) {
+			case 0x0000: EXECUTE(8XY0, 8xy0);
+			case 0x0001: EXECUTE(8XY1, 8xy1);
+			case 0x0002: EXECUTE(8XY2, 8xy2);
+			case 0x0003: EXECUTE(8XY3, 8xy3);
+			case 0x0004: EXECUTE(8XY4, 8xy4);
+			case 0x0005: EXECUTE(8XY5, 8xy5);
+			case 0x0006: EXECUTE(8XY6, 8xy6);
+			case 0x0007: EXECUTE(8XY7, 8xy7);
+			case 0x000E: EXECUTE(8XYE, 8xye);
+			}
 			break;
-
-		case 0x0015:
-			opcode_fx15(c8);
+		case 0x9000: EXECUTE(9XY0, 9xy0);
+		case 0xA000: EXECUTE(ANNN, annn);
+		case 0xB000: EXECUTE(BNNN, bnnn);
+		case 0xC000: EXECUTE(CXNN, cxnn);
+		case 0xD000: EXECUTE(DXYN, dxyn);
+		case 0xE000:
+			switch (ins->oc & 0x00FF) {
+			case 0x009E: EXECUTE(EX9E, ex9e);
+			case 0x00A1: EXECUTE(EXA1, exa1);
+			}
 			break;
-
-		case 0x0018:
-			opcode_fx18(c8);
+		case 0xF000:
+			switch (ins->oc & 0x00FF) {
+			case 0x0007: EXECUTE(FX07, fx07);
+			case 0x000A: EXECUTE(FX0A, fx0a);
+			case 0x0015: EXECUTE(FX15, fx15);
+			case 0x0018: EXECUTE(FX18, fx18);
+			case 0x001E: EXECUTE(FX1E, fx1e);
+			case 0x0029: EXECUTE(FX29, fx29);
+			case 0x0033: EXECUTE(FX33, fx33);
+			case 0x0055: EXECUTE(FX55, fx55);
+			case 0x0065: EXECUTE(FX65, fx65);
+			}
 			break;
+		}
+		EXECUTE(UNKNOWN, unknown);
+	}
+	#undef EXECUTE
+#endif
+	#undef END_INSTRUCTION
+
+stopped:
+	c8->pc = r.pc;
+	c8->I = r.I;
+	c8->cycles += executed;
+	c8->instructions += executed;
+	if (stop == CHIP8_STOP_BLOCKED)
+		idle_cycles(c8, n - executed);
+	*pressed = c8->keys_pressed;
+	return stop;
+}
 
-		case 0x001E:
-			opcode_fx1e(c8);
-			break;
+unsigned long long chip8_get_cycles(const Chip8 c8)
+{
+	return c8->cycles;
+}
 
-		case 0x0029:
-			opcode_fx29(c8);
-			break;
+unsigned long long chip8_get_instructions(const Chip8 c8)
+{
+	return c8->instructions;
+}
 
-		case 0x0033:
-			opcode_fx33(c8);
-			break;
+static ALWAYS_INLINE unsigned short read_opcode(const Chip8 c8,
+	unsigned short addr)
+{
+	return c8->memory[addr] << 8 | c8->memory[(addr + 1) & (MEMORY_SZ - 1)];
+}
 
-		case 0x0055:
-			opcode_fx55(c8);
-			break;
+static ALWAYS_INLINE void decode_instruction(unsigned short oc,
+	struct Instruction *ins)
+{
+	// the switch engine decodes oc itself
+#if !defined(CHIP8_DISPATCH_SWITCH)
+	ins->op = opcode_table[oc];
+#endif
+	ins->oc = oc;
+	ins->x = X(oc);
+	ins->y = Y(oc);
+	ins->n = N(oc);
+	ins->kk = kk(oc);
+	ins->nnn = NNN(oc);
+	ins->decoded = true;
+}
 
-		case 0x0065:
-			opcode_fx65(c8);
-			break;
+/*
+ * returns the instruction at pc, the plain interpreter decodes it on every
+ * call while the cached one decodes each address once and copies it out
+ */
+// the cached interpreter's miss path, kept out of line
+static void decode_slot(Chip8 c8, unsigned short pc)
+{
+	decode_instruction(read_opcode(c8, pc), &c8->decoded[pc]);
+}
 
-		default:
-			goto UNKNOWN_OPCODE;
+static ALWAYS_INLINE const struct Instruction* fetch_instruction(Chip8 c8,
+	unsigned short pc, struct Instruction *fetched)
+{
+	pc &= MEMORY_SZ - 1;
+	if (c8->interpreter == CHIP8_INTERPRETER_CACHED) {
+		struct Instruction *slot = &c8->decoded[pc];
+		if (!slot->decoded)
+			decode_slot(c8, pc);
+		return slot;
+	}
+
+	decode_instruction(read_opcode(c8, pc), fetched);
+	return fetched;
+}
+
+/*
+ * drops decoded slots overlapping [addr, addr + len) wrapped to memory like
+ * guest accesses are, an opcode starting one byte before addr is dropped as
+ * well since its low byte lives at addr
+ */
+static void invalidate_decoded(Chip8 c8, unsigned short addr, size_t len)
+{
+	if (len >= MEMORY_SZ)
+		len = MEMORY_SZ - 1;
+	for (size_t i = 0; i <= len; ++i)
+		c8->decoded[(addr - 1 + i) & (MEMORY_SZ - 1)].decoded = false;
+}
+
+/*
+ * maps a raw opcode to its handler id for the table, the masks match the
+ * nested switch of the switch engine so every engine decodes identically
+ */
+static unsigned char decode_opcode(unsigned short oc)
+{
+	switch (oc & 0xF000) {
+	case 0x0000:
+		switch (oc & 0x000F) {
+		case 0x0000: return OP_00E0;
+		case 0x000E: return OP_00EE;
+		}
+		break;
+	case 0x1000: return OP_1NNN;
+	case 0x2000: return OP_2NNN;
+	case 0x3000: return OP_3XNN;
+	case 0x4000: return OP_4XKK;
+	case 0x5000: return OP_5XY0;
+	case 0x6000: return OP_6XKK;
+	case 0x7000: return OP_7XNN;
+	case 0x8000:
+		switch (oc & 0x000F) {
+		case 0x0000: return OP_8XY0;
+		case 0x0001: return OP_8XY1;
+		case 0x0002: return OP_8XY2;
+		case 0x0003: return OP_8XY3;
+		case 0x0004: return OP_8XY4;
+		case 0x0005: return OP_8XY5;
+		case 0x0006: return OP_8XY6;
+		case 0x0007: return OP_8XY7;
+		case 0x000E: return OP_8XYE;
+		}
+		break;
+	case 0x9000: return OP_9XY0;
+	case 0xA000: return OP_ANNN;
+	case 0xB000: return OP_BNNN;
+	case 0xC000: return OP_CXNN;
+	case 0xD000: return OP_DXYN;
+	case 0xE000:
+		switch (oc & 0x00FF) {
+		case 0x009E: return OP_EX9E;
+		case 0x00A1: return OP_EXA1;
+		}
+		break;
+	case 0xF000:
+		switch (oc & 0x00FF) {
+		case 0x0007: return OP_FX07;
+		case 0x000A: return OP_FX0A;
+		case 0x0015: return OP_FX15;
+		case 0x0018: return OP_FX18;
+		case 0x001E: return OP_FX1E;
+		case 0x0029: return OP_FX29;
+		case 0x0033: return OP_FX33;
+		case 0x0055: return OP_FX55;
+		case 0x0065: return OP_FX65;
 		}
 		break;
-
-	default: UNKNOWN_OPCODE:
-		;char opc_str[32];
-		sprintf(opc_str, "\topcode: 0x%x", c8->opcode);
-		exit_log(FNAME, 2, "Failed executing opcode, unknown opcode.", opc_str);
 	}
-	c8->pc += 2;
+	return OP_UNKNOWN;
 }
 
-static void update_timers(Chip8 c8, unsigned hz)
+// decodes every possible opcode once so dispatch is a single table lookup
+static void build_opcode_table(void)
 {
-	if (c8->delay_timer > 0) {
-        float tick_duration = 1000.0f / hz / 1000.0f;
-		float curr_tick_time = (float)clock() / CLOCKS_PER_SEC;
-		if (curr_tick_time - c8->prev_tick_time >= tick_duration) {
-			--c8->delay_timer;
-		    c8->prev_tick_time = curr_tick_time;
-		}
+	for (unsigned oc = 0; oc <= 0xFFFF; ++oc)
+		opcode_table[oc] = decode_opcode((unsigned short)oc);
+}
+
+static void tick_timers(Chip8 c8, unsigned long ticks)
+{
+	c8->delay_timer = c8->delay_timer > ticks ? c8->delay_timer - ticks : 0;
+	c8->sound_timer = c8->sound_timer > ticks ? c8->sound_timer - ticks : 0;
+}
+
+// one instruction of guest time, below TIMER_HZ ips it spans several ticks
+static void step_timers(Chip8 c8)
+{
+	c8->timer_acc += TIMER_HZ;
+	if (c8->timer_acc >= c8->ips) {
+		tick_timers(c8, c8->timer_acc / c8->ips);
+		c8->timer_acc %= c8->ips;
 	}
+}
 
-	if (c8->sound_timer > 0) {
-        float tick_duration = 1000.0f / hz / 1000.0f;
-		float curr_tick_time = (float)clock() / CLOCKS_PER_SEC;
-		if (curr_tick_time - c8->prev_tick_time >= tick_duration) {
-			--c8->sound_timer;
-			c8->prev_tick_time = curr_tick_time;
-		}
+// tick the timers for every whole 60 Hz period passed on the monotonic clock
+static void update_wallclock_timers(Chip8 c8)
+{
+	double now = get_time();
+	unsigned long ticks = (unsigned long)((now - c8->timer_time) * TIMER_HZ);
+	if (ticks) {
+		tick_timers(c8, ticks);
+		c8->timer_time += (double)ticks / TIMER_HZ;
 	}
 }
+
+/*
+ * account for cycles spent waiting on fx0a, guest time keeps passing so the
+ * cycle counted timers keep running down
+ */
+static void idle_cycles(Chip8 c8, unsigned long n)
+{
+	c8->cycles += n;
+	if (c8->timers != CHIP8_TIMERS_CYCLES)
+		return;
+
+	unsigned long long acc = c8->timer_acc + (unsigned long long)n * TIMER_HZ;
+	tick_timers(c8, (unsigned long)(acc / c8->ips));
+	c8->timer_acc = (unsigned)(acc % c8->ips);
+}
+
 static unsigned short NNN(unsigned short oc) {
 	return oc & 0x0FFF;
 }
@@ -361,111 +998,136 @@ static unsigned char Y(unsigned short oc) {
 	return (oc & 0x00F0) >> 4;
 }
 
-#define OC c8->opcode	//undefined at line 651
+// report an opcode with no handler and terminate
+static void opcode_unknown(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
+{
+	char opc_str[32];
+	sprintf(opc_str, "\topcode: 0x%x", ins->oc);
+	exit_log(FNAME, 2, "Failed executing opcode, unknown opcode.", opc_str);
+}
 
 // clear the gfx
 //mk: Passed
-static void opcode_00e0(Chip8 c8)
+static ALWAYS_INLINE void opcode_00e0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	memset(c8->gfx, 0, GFX_SZ);
+	uint32_t lit_rows = 0;
+	for (size_t i = 0; i < CHIP8_DISPLAY_HEIGHT; ++i)
+		if (c8->gfx_rows[i])
+			lit_rows |= 1u << i;
+
+	memset(c8->gfx_rows, 0, sizeof(c8->gfx_rows));
+	mark_rows_changed(c8, lit_rows);
 }
 
-// return from subroutine
+// return from subroutine, sp wraps at STACK_SZ so bad ROMs stay in bounds
 //mk: passed
-static void opcode_00ee(Chip8 c8)
+static ALWAYS_INLINE void opcode_00ee(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->pc = c8->stack[--(c8->sp)];
+	c8->sp = (c8->sp - 1) & (STACK_SZ - 1);
+	r->pc = c8->stack[c8->sp];
 }
 
 // set pc to nnn
 //mk: passed
-static void opcode_1nnn(Chip8 c8)
+static ALWAYS_INLINE void opcode_1nnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->pc = NNN(OC);
-	c8->pc -= 2;
+	r->pc = ins->nnn;
+	r->pc -= 2;
 }
 
 // call subroutine at address nnn
 //mk: passed
-static void opcode_2nnn(Chip8 c8)
+static ALWAYS_INLINE void opcode_2nnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->stack[(c8->sp)++] = c8->pc;
-	c8->pc = NNN(OC);
-	c8->pc -= 2;
+	c8->stack[c8->sp & (STACK_SZ - 1)] = r->pc;
+	c8->sp = (c8->sp + 1) & (STACK_SZ - 1);
+	r->pc = ins->nnn;
+	r->pc -= 2;
 }
 
 // skip next instruction if V[x] == nn
 //mk: passed
-static void opcode_3xnn(Chip8 c8)
+static ALWAYS_INLINE void opcode_3xnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	if (c8->V[X(OC)] == kk(OC)) 
-		c8->pc += 2;
+	if (c8->V[ins->x] == ins->kk) 
+		r->pc += 2;
 }
 
 // skip next instruction if V[x] != kk
 //mk: passed
-static void opcode_4xkk(Chip8 c8)
+static ALWAYS_INLINE void opcode_4xkk(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	if (c8->V[X(OC)] != kk(OC))
-		c8->pc += 2;
+	if (c8->V[ins->x] != ins->kk)
+		r->pc += 2;
 }
 
 // skip next instruction if V[x] == V[y]
 //mk: passed
-static void opcode_5xy0(Chip8 c8)
+static ALWAYS_INLINE void opcode_5xy0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	if (c8->V[X(OC)] == c8->V[Y(OC)])
-		c8->pc += 2;
+	if (c8->V[ins->x] == c8->V[ins->y])
+		r->pc += 2;
 }
 
 // set V[x] to the value kk
 //mk: passed
-static void opcode_6xkk(Chip8 c8)
+static ALWAYS_INLINE void opcode_6xkk(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] = kk(OC);
+	c8->V[ins->x] = ins->kk;
 }
 
 // add nn to V[x]
 //mk: undefined edge case
-static void opcode_7xnn(Chip8 c8)
+static ALWAYS_INLINE void opcode_7xnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	//Checking if sum exceeds 8-bit value
-	if (c8->V[X(OC)] + kk(OC) > 0xFF) {
-		//printf("OC: %x\tX: %d\tKK: %d\tSum: %d\n",c8->opcode, c8->V[X(OC)], kk(OC), c8->V[X(OC)] + kk(OC));
-	}
-	c8->V[X(OC)] += kk(OC);
+	c8->V[ins->x] += ins->kk;
 }
 
 // set V[x] to V[y]
 //mk: passed
-static void opcode_8xy0(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] = c8->V[Y(OC)];
+	c8->V[ins->x] = c8->V[ins->y];
 }
 // set V[x] to bitwise OR of V[x] and V[y]
 //mk: done & passed
-static void opcode_8xy1(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy1(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] |= c8->V[Y(OC)];
+	c8->V[ins->x] |= c8->V[ins->y];
 }
 // set V[x] to bitwise AND of V[x] and V[y]
 //mk: passed 
-static void opcode_8xy2(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy2(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] &= c8->V[Y(OC)];
+	c8->V[ins->x] &= c8->V[ins->y];
 }
 // set V[x] to bitwise XOR of V[x] and V[y]
 //mk: done & passed
-static void opcode_8xy3(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy3(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] ^= c8->V[Y(OC)];
+	c8->V[ins->x] ^= c8->V[ins->y];
 }
 // set V[x] to V[x] + V[y], set V[0xF] if result > 8 bits, store first 8 bits
 //mk: passed
-static void opcode_8xy4(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy4(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	unsigned short res = c8->V[X(OC)] + c8->V[Y(OC)];
-	c8->V[X(OC)] = (unsigned char)res;
+	unsigned short res = c8->V[ins->x] + c8->V[ins->y];
+	c8->V[ins->x] = (unsigned char)res;
 	c8->V[0xf] = res > 0xFF;
 }
 
@@ -474,183 +1136,272 @@ static void opcode_8xy4(Chip8 c8)
 //as in Vx = 10 Vy= 15
 //is result stored as -5 with carry flag disabled
 //or result stored as +5 with carry flag disabled
-static void opcode_8xy5(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy5(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
 	//TODO (mk) change res into positive number if needed
-	signed short res = c8->V[X(OC)] - c8->V[Y(OC)];
+	signed short res = c8->V[ins->x] - c8->V[ins->y];
 	c8->V[0xf] = res > 0;
-	c8->V[X(OC)] = (unsigned char)res;
+	c8->V[ins->x] = (unsigned char)res;
 }
 //Set Vx = Vx SHR 1
 //mk: done & passed
-static void opcode_8xy6(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy6(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[0xf] = c8->V[X(OC)] & 1;
-	c8->V[X(OC)] >>= 1;
-	//c8->V[X(OC)] /= 2; same result
+	c8->V[0xf] = c8->V[ins->x] & 1;
+	c8->V[ins->x] >>= 1;
+	//c8->V[ins->x] /= 2; same result
 }
 
 //Set Vx = Vy - Vx, set VF = NOT borrow
 //Same issue as 8xy5
 //mk: conditionally passes
-static void opcode_8xy7(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xy7(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
 	//TODO (mk) change res into positive number if needed
-	signed short res = c8->V[Y(OC)] - c8->V[X(OC)];
+	signed short res = c8->V[ins->y] - c8->V[ins->x];
 	c8->V[0xf] = res > 0;
-	c8->V[X(OC)] = (unsigned char)res;
+	c8->V[ins->x] = (unsigned char)res;
 }
 //Set Vx = Vx SHL 1
 //mk: done & passed
-static void opcode_8xye(Chip8 c8)
+static ALWAYS_INLINE void opcode_8xye(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[0xf] = (c8->V[X(OC)] >> 7) & 1;
-	c8->V[X(OC)] <<= 1;
-	//c8->V[X(OC)] *= 2; same result
+	c8->V[0xf] = (c8->V[ins->x] >> 7) & 1;
+	c8->V[ins->x] <<= 1;
+	//c8->V[ins->x] *= 2; same result
 }
 //Skip next instruction if Vx != Vy
 //mk: done & passed
-static void opcode_9xy0(Chip8 c8)
+static ALWAYS_INLINE void opcode_9xy0(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	if (c8->V[X(OC)] != c8->V[Y(OC)])
-		c8->pc += 2;
+	if (c8->V[ins->x] != c8->V[ins->y])
+		r->pc += 2;
 }
 // set I to address nnn
 //mk: passed
-static void opcode_annn(Chip8 c8)
+static ALWAYS_INLINE void opcode_annn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->I = NNN(OC);
+	r->I = ins->nnn;
 }
 //Jump to location nnn + V0
 //mk: done & passed
-static void opcode_bnnn(Chip8 c8)
+static ALWAYS_INLINE void opcode_bnnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->pc = NNN(OC) + c8->V[0];
+	r->pc = ins->nnn + c8->V[0];
 }
 // set V[x] to a random number(0-255) & nn
-//mk: passed, rand() does not need to be limited to 1 byte range
-static void opcode_cxnn(Chip8 c8)
+//mk: passed
+static ALWAYS_INLINE void opcode_cxnn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] = rand() & OC;
+	c8->V[ins->x] = random_byte(c8) & ins->kk;
 }
 
 // draw sprite from I, at (x,y), n pixels high, set V[0xF] on collision
 //mk: looks ok, forced wrapping by modulus operation
 //		and skipping any unnecessary drawing
-static void opcode_dxyn(Chip8 c8)
+static ALWAYS_INLINE void opcode_dxyn(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	unsigned char x_pos = c8->V[X(OC)] % 64;
-	unsigned char y_pos = c8->V[Y(OC)] % 32;
-	unsigned char height = N(OC);
-
+	unsigned char x_pos = c8->V[ins->x] % CHIP8_DISPLAY_WIDTH;
+	unsigned char y_pos = c8->V[ins->y] % CHIP8_DISPLAY_HEIGHT;
+	unsigned char height = ins->n;
+	if (height > CHIP8_DISPLAY_HEIGHT - y_pos)
+		height = CHIP8_DISPLAY_HEIGHT - y_pos;
+
+	uint64_t collision = 0;
+	uint32_t changed_rows = 0;
+	uint64_t *row = c8->gfx_rows + y_pos;
 	for (unsigned char i = 0; i < height; ++i) {
-		unsigned char pixel = c8->memory[c8->I + i];
-		for (unsigned char j = 0; j < 8; ++j) {
-			if (y_pos + i < 32 && x_pos + j < 64) {
-				if (pixel & 0x80 >> j) {
-					c8->V[0xF] = c8->gfx[(y_pos + i) * 64 + x_pos + j];
-					c8->gfx[(y_pos + i) * 64 + x_pos + j] ^= 1;
-				}
-			}
-		}
+		uint64_t sprite = (uint64_t)c8->memory[(r->I + i) & (MEMORY_SZ - 1)]
+			<< (CHIP8_DISPLAY_WIDTH - 8) >> x_pos;
+		collision |= row[i] & sprite;
+		row[i] ^= sprite;
+		if (sprite)
+			changed_rows |= 1u << (y_pos + i);
 	}
+
+	c8->V[0xF] = collision != 0;
+	mark_rows_changed(c8, changed_rows);
+}
+
+// flag rows for renderers and the byte copy, bump the version on any change
+static void mark_rows_changed(Chip8 c8, uint32_t rows)
+{
+	if (!rows)
+		return;
+
+	c8->dirty_rows |= rows;
+	c8->stale_rows |= rows;
+	++c8->gfx_version;
 }
 
 // skip next instruction if key V[x] is pressed
 //mk: passed
-static void opcode_ex9e(Chip8 c8, Map keypad_state_map)
+static ALWAYS_INLINE void opcode_ex9e(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	if (map_get(keypad_state_map, c8->V[X(OC)]))
-		c8->pc += 2;
+	if (c8->keys & KEY_BIT(c8->V[ins->x]))
+		r->pc += 2;
 }
 
 // skip next instruction if key V[x] is not pressed
 //mk: passed
-static void opcode_exa1(Chip8 c8, Map keypad_state_map)
+static ALWAYS_INLINE void opcode_exa1(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	if (!map_get(keypad_state_map, c8->V[X(OC)]))
-		c8->pc += 2;
+	if (!(c8->keys & KEY_BIT(c8->V[ins->x])))
+		r->pc += 2;
 }
 
 // set V[x] to delay timer
 //mk: passed
-static void opcode_fx07(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx07(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->V[X(OC)] = c8->delay_timer;
+	c8->V[ins->x] = c8->delay_timer;
 }
 
 // halt execution until key is pressed, store key in V[x]
 //mk: passed
-static void opcode_fx0a(Chip8 c8, Map keypad_state_map)
+static ALWAYS_INLINE void opcode_fx0a(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	for(size_t i = 0; i < map_get_size(keypad_state_map); ++i)
-		if (map_get(keypad_state_map, i)) {
-			c8->execution_blocked = false;
-			c8->V[X(OC)] = (unsigned char)i;
-			return ;
-		}
-
+	c8->key_register = ins->x;
 	c8->execution_blocked = true;
+	poll_keypad(c8);
+}
+
+/*
+ * store the lowest newly pressed key in the register fx0a waits on and
+ * unblock, a key held since before the wait never completes it, presses are
+ * consumed so the next fx0a waits for a fresh one
+ */
+static void poll_keypad(Chip8 c8)
+{
+	if (!c8->keys_pressed)
+		return ;
+
+	c8->execution_blocked = false;
+	c8->V[c8->key_register] = (unsigned char)lowest_key(c8->keys_pressed);
+	c8->keys_pressed = 0;
+}
+
+// keys must not be 0
+static unsigned lowest_key(uint16_t keys)
+{
+#if defined(__GNUC__)
+	return (unsigned)__builtin_ctz(keys);
+#else
+	unsigned key = 0;
+	while (!(keys >> key & 1))
+		++key;
+	return key;
+#endif
+}
+
+static uint16_t map_to_keypad(const Map keypad_state_map)
+{
+	uint16_t keys = 0;
+	const int *map_keys = map_get_keys(keypad_state_map);
+	const int *values = map_get_values(keypad_state_map);
+	for (size_t i = 0; i < map_get_size(keypad_state_map); ++i)
+		if (values[i])
+			keys |= KEY_BIT(map_keys[i]);
+	return keys;
 }
 
 // set delay timer to V[x]
 //mk: passed
-static void opcode_fx15(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx15(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->delay_timer = c8->V[X(OC)];
-	c8->prev_tick_time = (float)clock() / CLOCKS_PER_SEC;
+	c8->delay_timer = c8->V[ins->x];
 }
 
 // set sound timer to V[x]
 //mk: passed
-static void opcode_fx18(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx18(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->sound_timer = c8->V[X(OC)];
-	c8->prev_tick_time = (float)clock() / CLOCKS_PER_SEC;
+	c8->sound_timer = c8->V[ins->x];
 }
 
 // set I = I + V[x]
 //mk: passes, but no check done for if I goes out of range
-static void opcode_fx1e(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx1e(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->I += c8->V[X(OC)];
+	r->I += c8->V[ins->x];
 }
 
 // store sprite for character V[x] at I
 //mk: passed, but no check done for if I goes out of range
-static void opcode_fx29(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx29(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	c8->I = c8->V[X(OC)] * 5;
+	r->I = c8->V[ins->x] * 5;
 }
 
 // store decimal value of V[x] starting at I
 //mk: passed, but no check done for if memory goes out of range
-static void opcode_fx33(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx33(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	unsigned short num = c8->V[X(OC)];
-	c8->memory[c8->I] = num / 100;
-	c8->memory[c8->I + 1] = num % 100 / 10;
-	c8->memory[c8->I + 2] = num % 10;
+	unsigned short num = c8->V[ins->x];
+	c8->memory[r->I & (MEMORY_SZ - 1)] = num / 100;
+	c8->memory[(r->I + 1) & (MEMORY_SZ - 1)] = num % 100 / 10;
+	c8->memory[(r->I + 2) & (MEMORY_SZ - 1)] = num % 10;
+	invalidate_decoded(c8, r->I, 3);
 }
 
 // store V[0] - V[x] starting at I
 //mk: passed, but no check done for if memory goes out of range
-static void opcode_fx55(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx55(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	for (size_t i = 0; i <= (size_t)X(OC); ++i)
-		c8->memory[c8->I + i] = c8->V[i];
+	for (size_t i = 0; i <= (size_t)ins->x; ++i)
+		c8->memory[(r->I + i) & (MEMORY_SZ - 1)] = c8->V[i];
+	invalidate_decoded(c8, r->I, (size_t)ins->x + 1);
 }
 
 // fills V[0] - V[x] with values starting at I
 //mk: passed
-static void opcode_fx65(Chip8 c8)
+static ALWAYS_INLINE void opcode_fx65(Chip8 c8, struct Registers *r,
+	const struct Instruction *ins)
 {
-	for (unsigned char i = 0; i <= X(OC); ++i)
-		c8->V[i] = c8->memory[c8->I + i];
+	for (unsigned char i = 0; i <= ins->x; ++i)
+		c8->V[i] = c8->memory[(r->I + i) & (MEMORY_SZ - 1)];
 }
-#undef OC
+
+// xorshift32, one stream per instance
+static unsigned char random_byte(Chip8 c8)
+{
+	uint32_t x = c8->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	c8->rng = x;
+	return (unsigned char)(x >> 24);
+}
+
+// returns pooled instances to their pool, frees standalone ones
 void chip8_destroy(Chip8 c8)
 {
-	free(c8);
-	instance_exists = false;
+	if (c8->pool) {
+		Chip8_pool pool = c8->pool;
+		size_t slot = ((unsigned char*)c8 - pool->slots) / pool->slot_sz;
+		pool->free_slots[pool->free_count++] = slot;
+		c8->pool = NULL;
+		return;
+	}
+
+	free(c8->allocation);
 }
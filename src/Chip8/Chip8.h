@@ -2,24 +2,109 @@
 #define CHIP8_H
 
 
+#include <stdint.h>
+
 #include "../utility/utility.h"
 
 
 #define CHIP8_DISPLAY_WIDTH 64
 #define CHIP8_DISPLAY_HEIGHT 32
+// instruction rate the cycle counted timers assume unless told otherwise
+#define CHIP8_DEFAULT_IPS 700
 
 
 typedef struct Chip8_t* Chip8;
 
+typedef struct Chip8_pool_t* Chip8_pool;
+
+typedef struct Chip8_state_t* Chip8_state;
+
+/*
+ * PLAIN decodes the opcode at pc on every cycle, CACHED keeps a decoded copy
+ * of every address which guest stores (fx33, fx55) invalidate
+ */
+typedef enum {
+	CHIP8_INTERPRETER_PLAIN,
+	CHIP8_INTERPRETER_CACHED
+} Chip8_interpreter;
+
+/*
+ * CYCLES ticks the delay and sound timers every ips / 60 executed cycles,
+ * WALLCLOCK ticks them at 60 Hz of the host monotonic clock
+ */
+typedef enum {
+	CHIP8_TIMERS_CYCLES,
+	CHIP8_TIMERS_WALLCLOCK
+} Chip8_timers;
+
+// reason chip8_run_cycles returned
+typedef enum {
+	CHIP8_STOP_BUDGET,	// all requested cycles executed
+	CHIP8_STOP_BLOCKED,	// fx0a is waiting for a key press
+	CHIP8_STOP_DRAW		// 00e0 or dxyn changed the display
+} Chip8_stop;
+
 
 Chip8 chip8_create(void);
 
+Chip8_pool chip8_pool_create(size_t capacity);
+
+Chip8 chip8_pool_acquire(Chip8_pool pool);
+
+void chip8_pool_destroy(Chip8_pool pool);
+
+void chip8_seed(Chip8 c8, unsigned long seed);
+
 void chip8_load_program(Chip8 c8, const char *file_path);
 
 const unsigned char* chip8_get_gfx(const Chip8 c8);
 
+// one row per display line, bit 63 is the leftmost pixel
+const uint64_t* chip8_get_gfx_rows(const Chip8 c8);
+
+unsigned long long chip8_get_gfx_version(const Chip8 c8);
+
+uint32_t chip8_get_dirty_rows(const Chip8 c8);
+
+void chip8_clear_dirty_rows(Chip8 c8);
+
+size_t chip8_snapshot_size(void);
+
+size_t chip8_snapshot(const Chip8 c8, unsigned char *buf);
+
+void chip8_restore(Chip8 c8, const unsigned char *buf, size_t sz);
+
+Chip8_state chip8_state_create(void);
+
+void chip8_state_save(const Chip8 c8, Chip8_state state);
+
+void chip8_state_load(Chip8 c8, const Chip8_state state);
+
+void chip8_state_destroy(Chip8_state state);
+
+void chip8_set_interpreter(Chip8 c8, Chip8_interpreter interpreter);
+
+void chip8_set_timers(Chip8 c8, Chip8_timers timers, unsigned ips);
+
+// keypad key to pressed (non zero) Map, adapts it to chip8_run_cycles
 void chip8_execute_opcode(Chip8 c8, const Map keypad_state_map);
 
+/*
+ * bit k of keys is set while keypad key k is held, pressed has the keys that
+ * went down since the caller last cleared it (even if already released
+ * again), fx0a only completes on one of those and removes it from pressed,
+ * callers clear pressed once the host frame it arrived in has run
+ */
+Chip8_stop chip8_run_cycles(Chip8 c8, unsigned long n, uint16_t keys,
+	uint16_t *pressed);
+
+// guest time, counts the cycles idled while fx0a waits as well
+unsigned long long chip8_get_cycles(const Chip8 c8);
+
+// instructions actually executed since the program was loaded
+unsigned long long chip8_get_instructions(const Chip8 c8);
+
+// also returns instances acquired from a pool back to it
 void chip8_destroy(Chip8 c8);
 
 
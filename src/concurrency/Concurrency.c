@@ -0,0 +1,215 @@
+#include "Concurrency.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+#endif
+
+#include "../utility/utility.h"
+
+
+#define FNAME "Concurrency.c"
+// set in the shared triple buffer index when it holds an unread slot
+#define FRESH_BIT 4
+#define INDEX_MASK 3
+// keeps the producer and consumer positions on separate cache lines
+#define CACHE_LINE_SZ 64
+
+
+struct Thread_t {
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	void (*func)(void *arg);
+	void *arg;
+};
+
+struct Triple_buffer_t {
+	size_t slot_sz;
+	unsigned char *slots;
+	unsigned back;			// writer only
+	unsigned front;			// reader only
+	atomic_uint middle;		// index of the shared slot, plus FRESH_BIT
+};
+
+// over-aligned, lives CACHE_LINE_SZ aligned inside a larger allocation
+struct Spsc_queue_t {
+	size_t elem_sz;
+	size_t mask;
+	unsigned char *elems;
+	void *allocation;
+	_Alignas(CACHE_LINE_SZ) atomic_size_t head;		// next pop, consumer
+	_Alignas(CACHE_LINE_SZ) atomic_size_t tail;		// next push, producer
+};
+
+
+#ifdef _WIN32
+static DWORD WINAPI thread_start(LPVOID arg)
+{
+	Thread thread = (Thread)arg;
+	thread->func(thread->arg);
+	return 0;
+}
+#else
+static void* thread_start(void *arg)
+{
+	Thread thread = (Thread)arg;
+	thread->func(thread->arg);
+	return NULL;
+}
+#endif
+
+Thread thread_create(void (*func)(void *arg), void *arg)
+{
+	Thread thread = (Thread)malloc(sizeof(struct Thread_t));
+	if (!thread)
+		exit_log(FNAME, 1, "Failed creating Thread, memory allocation fail.");
+
+	thread->func = func;
+	thread->arg = arg;
+#ifdef _WIN32
+	thread->handle = CreateThread(NULL, 0, thread_start, thread, 0, NULL);
+	if (!thread->handle)
+		exit_log(FNAME, 1, "Failed creating Thread, CreateThread failed.");
+#else
+	if (pthread_create(&thread->handle, NULL, thread_start, thread))
+		exit_log(FNAME, 1, "Failed creating Thread, pthread_create failed.");
+#endif
+	return thread;
+}
+
+// waits for the thread function to return and frees the thread
+void thread_join(Thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+	free(thread);
+}
+
+
+Triple_buffer triple_buffer_create(size_t slot_sz)
+{
+	Triple_buffer tb = (Triple_buffer)malloc(sizeof(struct Triple_buffer_t));
+	if (!tb)
+		exit_log(FNAME, 1,
+			"Failed creating Triple_buffer, memory allocation fail.");
+
+	tb->slots = (unsigned char*)calloc(3, slot_sz);
+	if (!tb->slots)
+		exit_log(FNAME, 1,
+			"Failed creating Triple_buffer, memory allocation fail.");
+
+	tb->slot_sz = slot_sz;
+	tb->back = 0;
+	tb->front = 1;
+	atomic_init(&tb->middle, 2);
+	return tb;
+}
+
+// slot owned by the writer until the next publish
+void* triple_buffer_write_slot(Triple_buffer tb)
+{
+	return tb->slots + tb->back * tb->slot_sz;
+}
+
+// swaps the written slot with the shared one, whatever the reader is doing
+void triple_buffer_publish(Triple_buffer tb)
+{
+	unsigned prev = atomic_exchange_explicit(&tb->middle,
+		tb->back | FRESH_BIT, memory_order_acq_rel);
+	tb->back = prev & INDEX_MASK;
+}
+
+/*
+ * newest published slot, owned by the reader until the next read, fresh is
+ * set when it was published since the previous read
+ */
+const void* triple_buffer_read(Triple_buffer tb, bool *fresh)
+{
+	*fresh = atomic_load_explicit(&tb->middle, memory_order_relaxed)
+		& FRESH_BIT;
+	if (*fresh) {
+		unsigned prev = atomic_exchange_explicit(&tb->middle, tb->front,
+			memory_order_acq_rel);
+		tb->front = prev & INDEX_MASK;
+	}
+	return tb->slots + tb->front * tb->slot_sz;
+}
+
+void triple_buffer_destroy(Triple_buffer tb)
+{
+	free(tb->slots);
+	free(tb);
+}
+
+
+// capacity is rounded up to a power of two
+Spsc_queue spsc_queue_create(size_t elem_sz, size_t capacity)
+{
+	size_t cap = 1;
+	while (cap < capacity)
+		cap <<= 1;
+
+	// malloc only guarantees fundamental alignment, align the struct by hand
+	void *allocation = malloc(sizeof(struct Spsc_queue_t) + CACHE_LINE_SZ - 1);
+	if (!allocation)
+		exit_log(FNAME, 1, "Failed creating Spsc_queue, memory allocation fail.");
+	uintptr_t addr = ((uintptr_t)allocation + CACHE_LINE_SZ - 1)
+		& ~(uintptr_t)(CACHE_LINE_SZ - 1);
+	Spsc_queue q = (Spsc_queue)addr;
+	q->allocation = allocation;
+
+	q->elems = (unsigned char*)malloc(elem_sz * cap);
+	if (!q->elems)
+		exit_log(FNAME, 1, "Failed creating Spsc_queue, memory allocation fail.");
+
+	q->elem_sz = elem_sz;
+	q->mask = cap - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return q;
+}
+
+// producer side, false when the queue is full
+bool spsc_queue_push(Spsc_queue q, const void *elem)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail - head > q->mask)
+		return false;
+
+	memcpy(q->elems + (tail & q->mask) * q->elem_sz, elem, q->elem_sz);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+// consumer side, false when the queue is empty
+bool spsc_queue_pop(Spsc_queue q, void *elem)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail)
+		return false;
+
+	memcpy(elem, q->elems + (head & q->mask) * q->elem_sz, q->elem_sz);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+void spsc_queue_destroy(Spsc_queue q)
+{
+	free(q->elems);
+	free(q->allocation);
+}
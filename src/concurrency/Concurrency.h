@@ -0,0 +1,45 @@
+#ifndef CONCURRENCY_CONCURRENCY_H
+#define CONCURRENCY_CONCURRENCY_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+typedef struct Thread_t* Thread;
+
+Thread thread_create(void (*func)(void *arg), void *arg);
+
+void thread_join(Thread thread);
+
+
+/*
+ * single writer, single reader handoff of whole values, the writer never
+ * waits and the reader always gets the newest published slot
+ */
+typedef struct Triple_buffer_t* Triple_buffer;
+
+Triple_buffer triple_buffer_create(size_t slot_sz);
+
+void* triple_buffer_write_slot(Triple_buffer tb);
+
+void triple_buffer_publish(Triple_buffer tb);
+
+const void* triple_buffer_read(Triple_buffer tb, bool *fresh);
+
+void triple_buffer_destroy(Triple_buffer tb);
+
+
+// bounded single producer, single consumer queue of fixed size elements
+typedef struct Spsc_queue_t* Spsc_queue;
+
+Spsc_queue spsc_queue_create(size_t elem_sz, size_t capacity);
+
+bool spsc_queue_push(Spsc_queue q, const void *elem);
+
+bool spsc_queue_pop(Spsc_queue q, void *elem);
+
+void spsc_queue_destroy(Spsc_queue q);
+
+
+#endif
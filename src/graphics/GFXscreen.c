@@ -1,100 +1,223 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "GFXscreen.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+	#include <direct.h>
+	#include <io.h>
+#else
+	#include <dirent.h>
+	#include <sys/stat.h>
+	#include <sys/types.h>
+#endif
+
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
-#define MATH_3D_IMPLEMENTATION
-#include <math_3d/math_3d.h>
+#include <math.h>
+
+#include "../scheduler/Pacer.h"
+// generated at build time by cmake/EmbedShaders.cmake
+#include "embedded_shaders.h"
 
 
 #define FNAME "GFXscreen.c"
 #define INFO_LOG_SZ 2048
+// 4 quads around the display, appended after the pixel quads of the mesh
+#define BOARDER_VERTICES (4 * 4)
+#define BOARDER_INDICES (4 * 6)
+// binding point of the Palette uniform block shared by both programs
+#define PALETTE_BINDING 0
+// rows past the width of the dirty mask are always treated as dirty
+#define ROW_DIRTY(rows, row) ((row) >= 64 || (rows) >> (row) & 1)
+// frames a streamed region may stay in flight before it is written again
+#define STREAM_REGIONS 3
+#define STREAM_WAIT_NS 1000000000ull
+// keypad changes buffered between two GFXscreen_process_input calls
+#define KEY_EVENTS_SZ 64
+#define KEY_UNMAPPED -1
+
+// GL 4.4 / GL_ARB_buffer_storage, not part of the bundled GL 4.0 loader
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP buffer_storage_proc)(GLenum target, GLsizeiptr size,
+	const void *data, GLbitfield flags);
+
+// GL 4.1 / GL_ARB_get_program_binary, likewise loaded by hand
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_PROGRAM_BINARY_LENGTH
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#endif
+typedef void (APIENTRYP get_program_binary_proc)(GLuint program,
+	GLsizei buf_sz, GLsizei *len, GLenum *format, void *binary);
+typedef void (APIENTRYP program_binary_proc)(GLuint program, GLenum format,
+	const void *binary, GLsizei len);
+typedef void (APIENTRYP program_parameteri_proc)(GLuint program, GLenum pname,
+	GLint value);
+
+// program cache files are named after an FNV-1a hash of driver and sources
+#define CACHE_PATH_SZ 1024
+#define CACHE_NAME_PREFIX "chip8-program-"
+#define CACHE_NAME_SZ 64
+// programs GFXscreen links, see program_sources
+#define PROGRAMS_SZ 2
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
 
 
 static void init_glfw(void);
 static void create_window(GFXscreen gfxs);
 static void init_glad(void);
 static void framebuffer_resize_cback(GLFWwindow *win, int w, int h);
-
-void create_program(GFXscreen gfxs, const char *vert_path,
-	const char *frag_path);
-static unsigned create_shader(const char *shader_path, GLenum shader_type);
-static char* load_shader(const char *shader_path);
-
-static void enable_pixel_coordinates(GFXscreen gfxs);
-
-static void generate_vertices(GFXscreen gfxs, unsigned boarder_thickns);
+static void key_cback(GLFWwindow *win, int key, int scancode, int action,
+	int mods);
+static bool push_key_event(GFXscreen gfxs, unsigned keypad, bool pressed,
+	double time);
+static bool resync_key_events(GFXscreen gfxs);
+
+static unsigned create_program(const char *vert_src, const char *frag_src);
+static unsigned create_shader(const char *shader_src, GLenum shader_type);
+static bool program_cache_dir(char *dir);
+static void program_cache_name(char *name, const char *vert_src,
+	const char *frag_src);
+static bool program_cache_path(char *path, const char *vert_src,
+	const char *frag_src);
+static uint64_t hash_string(uint64_t hash, const char *str);
+static unsigned load_program_binary(const char *path);
+static void save_program_binary(unsigned program, const char *path);
+static void create_parent_dirs(const char *path);
+static void prune_program_cache(void);
+static void remove_stale_binary(const char *dir, const char *name,
+	char keep[][CACHE_NAME_SZ], size_t keep_sz);
+
+static void update_transform(GFXscreen gfxs);
+static void set_transform(unsigned program, const float transform[4]);
+
+static void generate_vertices(GFXscreen gfxs);
 static void generate_indices(GFXscreen gfxs);
 
 static void create_vertex_array(GFXscreen gfxs);
 static void create_array_buffer_pos(GFXscreen gfxs);
 static void create_element_array_buffer(GFXscreen gfxs);
 
-static struct Boarder* create_boarder(unsigned w, unsigned h, unsigned thickns,
-	long color);
-static void generate_boarder_vertices(struct Boarder *boarder, unsigned w,
-	unsigned h, unsigned thickns);
-static void generate_boarder_indices(struct Boarder *boarder);
-static void generate_boarder_colors(struct Boarder *boarder, long color);
-static void create_boarder_vertex_array(struct Boarder *boarder);
-static void create_boarder_array_buffer_pos(struct Boarder *boarder);
-static void create_boarder_element_array_buffer(struct Boarder *boarder);
-static void create_boarder_array_buffer_col(struct Boarder *boarder);
-
-static void generate_colors(GFXscreen gfxs, const unsigned char gfx[]);
+static void generate_quad_vertices(GFXscreen gfxs);
+static void create_quad(GFXscreen gfxs);
+static void create_texture(GFXscreen gfxs);
+
+static void create_palette_buffer(GFXscreen gfxs, long color_on,
+	long color_off);
+static void bind_palette_block(unsigned program);
+
+static void generate_boarder_vertices(GFXscreen gfxs);
+static void generate_boarder_indices(GFXscreen gfxs);
+
+static void generate_row_colors(GFXscreen gfxs, const unsigned char gfx[],
+	size_t row, unsigned char *colors);
 static void create_array_buffer_col(GFXscreen gfxs);
+static void update_array_buffer_col(GFXscreen gfxs, const unsigned char gfx[],
+	uint64_t dirty_rows);
+static void update_texture(GFXscreen gfxs, const unsigned char gfx[],
+	uint64_t dirty_rows);
 
-static void destroy_boarder(struct Boarder *boarder);
+static struct Stream* create_stream(Arena arena, size_t region_sz);
+static unsigned char* stream_begin(struct Stream *stream, GLenum target);
+static void stream_flush(struct Stream *stream, GLenum target, size_t offset,
+	size_t len);
+static void stream_end(struct Stream *stream);
+static void destroy_stream(struct Stream *stream);
 
 
 static bool instance_exists = false;
 static GFXscreen active_instance;
+static buffer_storage_proc buffer_storage;
+static get_program_binary_proc get_program_binary;
+static program_binary_proc program_binary;
+static program_parameteri_proc program_parameteri;
+
+// every program GFXscreen links, their current binaries survive pruning
+static const char *const program_sources[PROGRAMS_SZ][2] = {
+	{ shader_vert, shader_frag },
+	{ screen_tex_vert, screen_tex_frag }
+};
 
 
 struct GFXscreen_t {
+	// owns the struct itself and every heap buffer below
+	Arena arena;
 	unsigned w;
 	unsigned h;
 	char *title;
 	GLFWwindow *win;
 	bool window_close;
 	unsigned program;
+	unsigned tex_program;
+	GFXscreen_renderer renderer;
+	GFXscreen_present present_mode;
+	bool full_upload;
 	unsigned gfx_w;
 	unsigned gfx_h;
 	size_t vertices_sz;
 	float *vertices;
-	float pixel_sz;
+	// boarder thickness in chip8 pixels, geometry is laid out in those units
+	float boarder_sz;
+	bool integer_scaling;
+	bool resize_pending;
 	size_t indices_sz;
 	unsigned *indices;
 	unsigned vertex_array;
 	unsigned array_buffer_pos;
 	unsigned element_array_buffer;
-	Map keypad_keyboard_map;
-	Map keypad_state_map;
-	long color_on;
-	long color_off;
+	// keypad key per GLFW key, KEY_UNMAPPED for keys outside the keypad
+	signed char key_to_keypad[GLFW_KEY_LAST + 1];
+	uint16_t keypad;
+	// ring of keypad changes not yet taken by GFXscreen_next_key_event
+	GFXscreen_key_event key_events[KEY_EVENTS_SZ];
+	unsigned key_events_head;
+	unsigned key_events_count;
+	uint16_t keypad_taken;		// keypad as the events taken left it
+	double key_events_dropped;	// time of the first dropped event, 0 if none
+	bool rewind_held;
+	// rgba per palette entry, mirrors the std140 Palette uniform block
+	float palette[GFXSCREEN_PALETTE_SZ * 4];
+	unsigned palette_buffer;
 	size_t colors_sz;
-	float *colors;
 	unsigned array_buffer_col;
+	// (x, y) position and (u, v) texel coordinates of tl, tr, bl, br
+	float quad_vertices[4 * 4];
+	unsigned quad_vertex_array;
+	unsigned quad_array_buffer;
+	unsigned texture;
 	unsigned fps;
-	double prev_frame;
-	struct Boarder *boarder;
+	Pacer pacer;
+	struct Stream *stream;
 };
 
-struct Boarder {
-	unsigned width;
-	size_t vertices_sz;
-	float *vertices;
-	size_t indices_sz;
-	unsigned *indices;
-	size_t colors_sz;
-	float *colors;
-	unsigned vertex_array;
-	unsigned array_buffer_pos;
-	unsigned element_array_buffer;
-	unsigned array_buffer_col;
+/*
+ * upload ring shared by both render paths, each frame writes its own region
+ * which is fenced once the GPU commands reading it are queued, when buffer
+ * storage is missing a single orphaned buffer filled by glBufferSubData from
+ * staging memory is used instead
+ */
+struct Stream {
+	unsigned buffer;
+	size_t region_sz;
+	unsigned region;
+	size_t base;			// offset of the region written this frame
+	bool pending;			// region written since the last stream_end
+	unsigned char *mapped;	// persistent mapping, NULL in the fallback
+	unsigned char *staging;	// region_sz bytes of memory for the fallback
+	GLsync fences[STREAM_REGIONS];
 };
 
 
@@ -110,84 +233,127 @@ GFXscreen GFXscreen_create(unsigned w, unsigned h, const char *title,
 	if (!graphics_modules_init)
 		init_glfw();
 
-	GFXscreen gfxs = (GFXscreen)malloc(sizeof(struct GFXscreen_t));
-	if (!gfxs)
-		exit_log(FNAME, 1,
-			"Failed creating GFXscreen, memory allocation fail.");
+	size_t title_len = title ? strlen(title) : 0;
+	// 4 vertices per pixel (tl, tr, bl, br), 2 coordinates per vertex (x, y)
+	size_t vertices_sz = (gfx_w * 4 * gfx_h + BOARDER_VERTICES) * 2;
+	// 6 indices per pixel (3 for tr triangle and 3 for bl triangle)
+	size_t indices_sz = gfx_w * gfx_h * 6 + BOARDER_INDICES;
+	// 4 vertices per pixel (tl, tr, bl, br), 1 palette index per vertex
+	size_t colors_sz = gfx_w * 4 * gfx_h;
+	// large enough for a full frame of either palette indices or texels
+	size_t stream_sz = colors_sz > gfx_w * gfx_h ? colors_sz : gfx_w * gfx_h;
+
+	// everything the instance keeps on the heap lives in this one block
+	Arena arena = arena_create(
+		arena_size(sizeof(struct GFXscreen_t))
+		+ arena_size(sizeof(char) * (title_len + 1))
+		+ arena_size(sizeof(float) * vertices_sz)
+		+ arena_size(sizeof(unsigned) * indices_sz)
+		+ arena_size(sizeof(struct Stream))
+		+ arena_size(stream_sz)
+	);
+	GFXscreen gfxs = (GFXscreen)arena_alloc(arena, sizeof(struct GFXscreen_t));
+	gfxs->arena = arena;
 
 	gfxs->w = w;
 	gfxs->h = h;
 	
-	if (title) {
-		size_t title_len = strlen(title);
-		gfxs->title = (char*)malloc(sizeof(char) * (title_len + 1));
-		if (!gfxs->title)
-			exit_log(FNAME, 1,
-				"Failed creating GFXsceen, memory allocation fail.");
-		strncpy(gfxs->title, title, title_len);
-		gfxs->title[title_len] = '\0';
-	}
-	else {
-		gfxs->title = (char*)malloc(sizeof(char));
-		if (!gfxs->title)
-			exit_log(FNAME, 1,
-				"Failed creating GFXsceen, memory allocation fail.");
-		*(gfxs->title) = '\0';
-	}
+	gfxs->title = (char*)arena_alloc(arena, sizeof(char) * (title_len + 1));
+	if (title_len)
+		memcpy(gfxs->title, title, title_len);
+	gfxs->title[title_len] = '\0';
 
 	create_window(gfxs);
 	gfxs->window_close = false;
 
 	if (!graphics_modules_init) {
 		init_glad();
+		if (glfwExtensionSupported("GL_ARB_buffer_storage"))
+			buffer_storage =
+				(buffer_storage_proc)glfwGetProcAddress("glBufferStorage");
+		if (glfwExtensionSupported("GL_ARB_get_program_binary")) {
+			get_program_binary = (get_program_binary_proc)
+				glfwGetProcAddress("glGetProgramBinary");
+			program_binary =
+				(program_binary_proc)glfwGetProcAddress("glProgramBinary");
+			program_parameteri = (program_parameteri_proc)
+				glfwGetProcAddress("glProgramParameteri");
+		}
 		graphics_modules_init = true;
 	}
 
 	glfwSetFramebufferSizeCallback(gfxs->win, framebuffer_resize_cback);
+	glfwSetKeyCallback(gfxs->win, key_cback);
 
-	create_program(gfxs, "../src/graphics/shader.vert",
-    "../src/graphics/shader.frag");
-	enable_pixel_coordinates(gfxs);
+	gfxs->program = create_program(program_sources[0][0],
+		program_sources[0][1]);
+	gfxs->tex_program = create_program(program_sources[1][0],
+		program_sources[1][1]);
 
 	gfxs->gfx_w = gfx_w;
 	gfxs->gfx_h = gfx_h;
-	// 4 vertices per pixel (tl, tr, bl, br), 2 coordinates per vertex (x, y)
-	gfxs->vertices_sz = gfx_w * 4 * 2 * gfx_h;
-	gfxs->vertices = (float*)malloc(sizeof(float) * gfxs->vertices_sz);
-	if (!gfxs->vertices)
-		exit_log(FNAME, 1,
-			"Failed creating GFXscreen, memory allocation fail.");
-	generate_vertices(gfxs, boarder_thickns);
+
+	/* 
+	 * determines the lesser of pixel height or pixel width at the requested
+	 * window size, the boarder keeps its proportion to the pixels from there
+	 */
+	float pixel_sz =
+		((float)w - boarder_thickns * 2) / gfx_w
+		<
+		((float)h - boarder_thickns * 2) / gfx_h
+			? ((float)w - boarder_thickns * 2) / gfx_w
+			: ((float)h - boarder_thickns * 2) / gfx_h;
+	gfxs->boarder_sz = boarder_thickns / pixel_sz;
+	gfxs->integer_scaling = false;
+
+	// the framebuffer may be larger than the window on high dpi displays
+	int fb_w;
+	int fb_h;
+	glfwGetFramebufferSize(gfxs->win, &fb_w, &fb_h);
+	gfxs->w = fb_w;
+	gfxs->h = fb_h;
+	gfxs->resize_pending = true;
+
+	gfxs->vertices_sz = vertices_sz;
+	gfxs->vertices = (float*)arena_alloc(arena, sizeof(float) * vertices_sz);
+	generate_vertices(gfxs);
+	generate_boarder_vertices(gfxs);
 	
-	// 6 indices per pixel (3 for tr triangle and 3 for bl triangle)
-	gfxs->indices_sz = gfx_w * gfx_h * 6;
-	gfxs->indices = (unsigned*)malloc(sizeof(unsigned) * gfxs->indices_sz);
+	gfxs->indices_sz = indices_sz;
+	gfxs->indices = (unsigned*)arena_alloc(arena, sizeof(unsigned) * indices_sz);
 	generate_indices(gfxs);
+	generate_boarder_indices(gfxs);
 
 	create_vertex_array(gfxs);
 	gfxs->array_buffer_pos = 0;
 	create_array_buffer_pos(gfxs);
 	create_element_array_buffer(gfxs);
 
-	gfxs->keypad_keyboard_map = map_create(0);
-	gfxs->keypad_state_map = map_create(0);
+	memset(gfxs->key_to_keypad, KEY_UNMAPPED, sizeof(gfxs->key_to_keypad));
+	gfxs->keypad = 0;
+	gfxs->key_events_head = 0;
+	gfxs->key_events_count = 0;
+	gfxs->keypad_taken = 0;
+	gfxs->key_events_dropped = 0.0;
+	gfxs->rewind_held = false;
 
-	gfxs->color_on = color_on;
-	gfxs->color_off = color_off;
-	// 4 vertices per pixel (tl, tr, bl, br), 3 colors per vertex (r, g, b)
-	gfxs->colors_sz = gfx_w * 4 * 3 * gfx_h;
-	gfxs->colors = (float*)malloc(sizeof(float) * gfxs->colors_sz);
-	if (!gfxs->colors)
-		exit_log(FNAME, 1,
-			"Failed creating GFXscreen, memory allocation fail.");
-	gfxs->array_buffer_col = 0;
+	create_palette_buffer(gfxs, color_on, color_off);
+	gfxs->colors_sz = colors_sz;
+	create_array_buffer_col(gfxs);
 
-	gfxs->fps = fps;
-	gfxs->prev_frame = 0.0;
+	generate_quad_vertices(gfxs);
+	create_quad(gfxs);
+	create_texture(gfxs);
 
-	gfxs->boarder = create_boarder(gfx_w * gfxs->pixel_sz + boarder_thickns * 2,
-		gfx_h * gfxs->pixel_sz + boarder_thickns * 2, boarder_thickns,
-		color_on);
+	gfxs->stream = create_stream(arena, stream_sz);
+
+	gfxs->renderer = GFXSCREEN_RENDER_TEXTURE;
+	gfxs->full_upload = true;
+
+	gfxs->fps = fps;
+	gfxs->pacer = pacer_create(fps);
+	// create_window turned vsync off
+	gfxs->present_mode = GFXSCREEN_PRESENT_PACED;
 
 	instance_exists = true;
 	active_instance = gfxs;
@@ -234,52 +400,130 @@ static void init_glad(void)
 		exit_log(FNAME, 1, "Failed initializing GLAD.");
 }
 
+// geometry never changes, the transform is recomputed once at the next frame
 static void framebuffer_resize_cback(GLFWwindow *win, int w, int h)
 {
-	glViewport(0, 0, w, h);
 	active_instance->w = w;
 	active_instance->h = h;
-	enable_pixel_coordinates(active_instance);
+	active_instance->resize_pending = true;
+}
 
-	unsigned thickns = active_instance->boarder->width;
+/*
+ * runs inside glfwPollEvents, keypad keys go through the lookup table into
+ * the held mask and the event ring, when the ring is full the event is
+ * dropped but the mask still follows the key and the ring is resynced from
+ * it once drained, repeats carry no new state
+ */
+static void key_cback(GLFWwindow *win, int key, int scancode, int action,
+	int mods)
+{
+	GFXscreen gfxs = active_instance;
+	if (action == GLFW_REPEAT || key < 0 || key > GLFW_KEY_LAST)
+		return ;
+
+	bool pressed = action == GLFW_PRESS;
+	if (key == GLFW_KEY_ESCAPE && pressed)
+		glfwSetWindowShouldClose(win, 1);
+	if (key == GLFW_KEY_BACKSPACE)
+		gfxs->rewind_held = pressed;
+
+	int keypad = gfxs->key_to_keypad[key];
+	if (keypad == KEY_UNMAPPED)
+		return ;
+
+	if (pressed)
+		gfxs->keypad |= 1u << keypad;
+	else
+		gfxs->keypad &= ~(1u << keypad);
+
+	double now = get_time();
+	if (!push_key_event(gfxs, keypad, pressed, now)
+		&& gfxs->key_events_dropped == 0.0)
+		gfxs->key_events_dropped = now;
+}
 
-	generate_vertices(active_instance, thickns);
-	create_array_buffer_pos(active_instance);
+static bool push_key_event(GFXscreen gfxs, unsigned keypad, bool pressed,
+	double time)
+{
+	if (gfxs->key_events_count == KEY_EVENTS_SZ)
+		return false;
+
+	GFXscreen_key_event *event = gfxs->key_events
+		+ (gfxs->key_events_head + gfxs->key_events_count) % KEY_EVENTS_SZ;
+	event->keypad = (unsigned char)keypad;
+	event->pressed = pressed;
+	event->time = time;
+	++gfxs->key_events_count;
+	return true;
+}
 
-	generate_boarder_vertices(active_instance->boarder,
-		active_instance->gfx_w * active_instance->pixel_sz + thickns * 2,
-		active_instance->gfx_h * active_instance->pixel_sz + thickns * 2,
-		thickns);
-	create_boarder_array_buffer_pos(active_instance->boarder);
+/*
+ * after a drop, queues one change per key whose held state differs from what
+ * the events taken so far left it at, timed at the first drop, a press and
+ * release that were both dropped are lost but no key is left stuck
+ */
+static bool resync_key_events(GFXscreen gfxs)
+{
+	if (gfxs->key_events_dropped == 0.0)
+		return false;
+
+	uint16_t changed = gfxs->keypad ^ gfxs->keypad_taken;
+	for (unsigned key = 0; key < GFXSCREEN_KEYPAD_SZ; ++key)
+		if (changed >> key & 1)
+			push_key_event(gfxs, key, gfxs->keypad >> key & 1,
+				gfxs->key_events_dropped);
+	gfxs->key_events_dropped = 0.0;
+	return changed != 0;
 }
 
-void create_program(GFXscreen gfxs, const char *vert_path, const char *frag_path)
+/*
+ * links the program from the embedded sources, or straight from a cached
+ * binary when the driver saved one for these exact sources before, a binary
+ * the driver rejects (e.g. after an update it failed to catch) is relinked
+ * and its cache file overwritten
+ */
+static unsigned create_program(const char *vert_src, const char *frag_src)
 {
-	gfxs->program = glCreateProgram();
-	unsigned vert_shader = create_shader(vert_path, GL_VERTEX_SHADER);
-	unsigned frag_shader = create_shader(frag_path, GL_FRAGMENT_SHADER);
-	glAttachShader(gfxs->program, vert_shader);
-	glAttachShader(gfxs->program, frag_shader);
-	glLinkProgram(gfxs->program);
+	char cache_path[CACHE_PATH_SZ];
+	bool cacheable = program_cache_path(cache_path, vert_src, frag_src);
+	if (cacheable) {
+		unsigned program = load_program_binary(cache_path);
+		if (program)
+			return program;
+	}
+
+	unsigned program = glCreateProgram();
+	unsigned vert_shader = create_shader(vert_src, GL_VERTEX_SHADER);
+	unsigned frag_shader = create_shader(frag_src, GL_FRAGMENT_SHADER);
+	glAttachShader(program, vert_shader);
+	glAttachShader(program, frag_shader);
+	if (cacheable)
+		program_parameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+			GL_TRUE);
+	glLinkProgram(program);
 
 	int status;
-	glGetProgramiv(gfxs->program, GL_LINK_STATUS, &status);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
 	if (!status) {
 		char info_log[INFO_LOG_SZ];
-		glGetProgramInfoLog(gfxs->program, INFO_LOG_SZ, NULL, info_log);
+		glGetProgramInfoLog(program, INFO_LOG_SZ, NULL, info_log);
 		exit_log(FNAME, 2, "Failed linking program.", info_log);
 	}
 
+	glDetachShader(program, vert_shader);
+	glDetachShader(program, frag_shader);
 	glDeleteShader(vert_shader);
 	glDeleteShader(frag_shader);
-	glUseProgram(gfxs->program);
+
+	if (cacheable)
+		save_program_binary(program, cache_path);
+	return program;
 }
 
-static unsigned create_shader(const char *shader_path, GLenum shader_type)
+static unsigned create_shader(const char *shader_src, GLenum shader_type)
 {
 	unsigned shader = glCreateShader(shader_type);
-	char *shader_data = load_shader(shader_path);
-	glShaderSource(shader, 1, (const char**)&shader_data, NULL);
+	glShaderSource(shader, 1, &shader_src, NULL);
 	glCompileShader(shader);
 	
 	int status;
@@ -293,52 +537,276 @@ static unsigned create_shader(const char *shader_path, GLenum shader_type)
 			exit_log(FNAME, 2, "Failed compiling fragment shader.", info_log);
 	}
 
-	free(shader_data);
 	return shader;
 }
 
-static char* load_shader(const char *shader_path)
+/*
+ * chip8 directory inside the per user cache directory, false if binaries
+ * aren't supported or there's no cache directory
+ */
+static bool program_cache_dir(char *dir)
 {
-	FILE *f = fopen(shader_path, "r");
+	if (!get_program_binary || !program_binary || !program_parameteri)
+		return false;
+
+#if defined(_WIN32)
+	const char *base = getenv("LOCALAPPDATA");
+	const char *sub_dir = "";
+#elif defined(__APPLE__)
+	const char *base = getenv("HOME");
+	const char *sub_dir = "/Library/Caches";
+#else
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *sub_dir = "";
+	if (!base || !*base) {
+		base = getenv("HOME");
+		sub_dir = "/.cache";
+	}
+#endif
+	if (!base || !*base)
+		return false;
+
+	int len = snprintf(dir, CACHE_PATH_SZ, "%s%s/chip8", base, sub_dir);
+	return len > 0 && len < CACHE_PATH_SZ;
+}
+
+/*
+ * the name keys on vendor, renderer and version as well as the sources so a
+ * driver change never loads a stale binary
+ */
+static void program_cache_name(char *name, const char *vert_src,
+	const char *frag_src)
+{
+	uint64_t key = FNV_OFFSET;
+	key = hash_string(key, (const char*)glGetString(GL_VENDOR));
+	key = hash_string(key, (const char*)glGetString(GL_RENDERER));
+	key = hash_string(key, (const char*)glGetString(GL_VERSION));
+	key = hash_string(key, vert_src);
+	key = hash_string(key, frag_src);
+
+	snprintf(name, CACHE_NAME_SZ, CACHE_NAME_PREFIX "%016llx.bin",
+		(unsigned long long)key);
+}
+
+static bool program_cache_path(char *path, const char *vert_src,
+	const char *frag_src)
+{
+	char dir[CACHE_PATH_SZ];
+	if (!program_cache_dir(dir))
+		return false;
+
+	char name[CACHE_NAME_SZ];
+	program_cache_name(name, vert_src, frag_src);
+	int len = snprintf(path, CACHE_PATH_SZ, "%s/%s", dir, name);
+	return len > 0 && len < CACHE_PATH_SZ;
+}
+
+// FNV-1a, the terminator is hashed too so adjacent strings can't run together
+static uint64_t hash_string(uint64_t hash, const char *str)
+{
+	if (!str)
+		str = "";
+	do {
+		hash ^= (unsigned char)*str;
+		hash *= FNV_PRIME;
+	} while (*str++);
+	return hash;
+}
+
+/*
+ * the file holds the binary format followed by the binary itself, 0 on a
+ * missing or unreadable file or when the driver refuses the binary
+ */
+static unsigned load_program_binary(const char *path)
+{
+	FILE *f = fopen(path, "rb");
 	if (!f)
-		exit_log(FNAME, 2, "Failed loading shader, bad path.", shader_path);
+		return 0;
 
 	fseek(f, 0, SEEK_END);
-	size_t len = ftell(f);
+	long len = ftell(f);
 	rewind(f);
 
-	char *data = (char*)malloc(sizeof(char) * len + 1);
-	if (!data)
-		exit_log(FNAME, 1, "Failed loading shader, memory allocation failed.");
-	for (size_t i = 0; i < len - 1; ++i)
-		data[i] = fgetc(f);
-	data[len - 1] = '\0';
-
+	GLenum format;
+	unsigned char *binary = NULL;
+	long binary_sz = len - (long)sizeof(format);
+	if (binary_sz > 0)
+		binary = (unsigned char*)malloc(binary_sz);
+	bool loaded = binary && fread(&format, sizeof(format), 1, f) == 1
+		&& fread(binary, 1, binary_sz, f) == (size_t)binary_sz;
 	fclose(f);
-	return data;
+	if (!loaded) {
+		free(binary);
+		return 0;
+	}
+
+	unsigned program = glCreateProgram();
+	program_binary(program, format, binary, (GLsizei)binary_sz);
+	free(binary);
+
+	int status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
 }
 
-static void enable_pixel_coordinates(GFXscreen gfxs)
+// best effort, a program that can't be cached is simply linked again next time
+static void save_program_binary(unsigned program, const char *path)
 {
-	mat4_t ortho = m4_ortho(0, gfxs->w, gfxs->h, 0, 0, 1);
-	glUniformMatrix4fv(glGetUniformLocation(gfxs->program, "ortho"), 1,
-		GL_FALSE, &ortho.m00);
+	int len = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &len);
+	if (len <= 0)
+		return;
+
+	unsigned char *binary = (unsigned char*)malloc(len);
+	if (!binary)
+		return;
+	GLenum format;
+	GLsizei written = 0;
+	get_program_binary(program, len, &written, &format, binary);
+
+	if (written > 0)
+		create_parent_dirs(path);
+	FILE *f = written > 0 ? fopen(path, "wb") : NULL;
+	if (f) {
+		bool ok = fwrite(&format, sizeof(format), 1, f) == 1
+			&& fwrite(binary, 1, written, f) == (size_t)written;
+		// a partial file would only be rejected and relinked, drop it anyway
+		if (fclose(f) != 0 || !ok)
+			remove(path);
+		else
+			prune_program_cache();
+	}
+	free(binary);
 }
 
-static void generate_vertices(GFXscreen gfxs, unsigned boarder_thickns)
+// the cache directory may not exist yet on a fresh account, mkdir -p it
+static void create_parent_dirs(const char *path)
 {
-	/* 
-	 * determines the lesser of pixel height or pixel width, uses it as the
-	 * unified size inorder to maximize window usage and keep pixels squared,
-	 * includes padding required for border
-	 */
-	gfxs->pixel_sz =
-		((float)gfxs->w - boarder_thickns * 2) / gfxs->gfx_w 
-		<
-		((float)gfxs->h - boarder_thickns * 2) / gfxs->gfx_h
-			? ((float)gfxs->w - boarder_thickns * 2) / gfxs->gfx_w
-			: ((float)gfxs->h - boarder_thickns * 2) / gfxs->gfx_h;
-	float pixel_sz = gfxs->pixel_sz;
+	char dir[CACHE_PATH_SZ];
+	for (size_t i = 1; path[i] && i < CACHE_PATH_SZ; ++i) {
+		if (path[i] != '/' && path[i] != '\\')
+			continue;
+
+		// existing directories just fail, fopen reports anything worse
+		memcpy(dir, path, i);
+		dir[i] = '\0';
+#ifdef _WIN32
+		_mkdir(dir);
+#else
+		mkdir(dir, 0755);
+#endif
+	}
+}
+
+/*
+ * every driver or shader change leaves a binary behind, once a new one is
+ * written the ones no program of this build on this driver would load go
+ */
+static void prune_program_cache(void)
+{
+	char dir[CACHE_PATH_SZ];
+	if (!program_cache_dir(dir))
+		return;
+
+	char keep[PROGRAMS_SZ][CACHE_NAME_SZ];
+	for (size_t i = 0; i < PROGRAMS_SZ; ++i)
+		program_cache_name(keep[i], program_sources[i][0],
+			program_sources[i][1]);
+
+#ifdef _WIN32
+	char pattern[CACHE_PATH_SZ];
+	int len = snprintf(pattern, CACHE_PATH_SZ, "%s/" CACHE_NAME_PREFIX "*.bin",
+		dir);
+	if (len <= 0 || len >= CACHE_PATH_SZ)
+		return;
+
+	struct _finddata_t found;
+	intptr_t find = _findfirst(pattern, &found);
+	if (find == -1)
+		return;
+	do
+		remove_stale_binary(dir, found.name, keep, PROGRAMS_SZ);
+	while (_findnext(find, &found) == 0);
+	_findclose(find);
+#else
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(d)))
+		remove_stale_binary(dir, entry->d_name, keep, PROGRAMS_SZ);
+	closedir(d);
+#endif
+}
+
+// only program binaries are touched, anything else in dir is left alone
+static void remove_stale_binary(const char *dir, const char *name,
+	char keep[][CACHE_NAME_SZ], size_t keep_sz)
+{
+	size_t len = strlen(name);
+	size_t prefix_len = strlen(CACHE_NAME_PREFIX);
+	if (len < prefix_len + 4 || strncmp(name, CACHE_NAME_PREFIX, prefix_len)
+		|| strcmp(name + len - 4, ".bin"))
+		return;
+	for (size_t i = 0; i < keep_sz; ++i)
+		if (!strcmp(name, keep[i]))
+			return;
+
+	char path[CACHE_PATH_SZ];
+	int path_len = snprintf(path, CACHE_PATH_SZ, "%s/%s", dir, name);
+	if (path_len > 0 && path_len < CACHE_PATH_SZ)
+		remove(path);
+}
+
+/*
+ * scales the bordered display to fit the framebuffer, centers it and maps it
+ * to clip space, with integer scaling the scale is snapped down to a whole
+ * number of framebuffer pixels per chip8 pixel whenever it is at least one
+ */
+static void update_transform(GFXscreen gfxs)
+{
+	float content_w = gfxs->gfx_w + gfxs->boarder_sz * 2;
+	float content_h = gfxs->gfx_h + gfxs->boarder_sz * 2;
+	float scale = gfxs->w / content_w < gfxs->h / content_h
+		? gfxs->w / content_w
+		: gfxs->h / content_h;
+	if (gfxs->integer_scaling && scale >= 1.0f)
+		scale = floorf(scale);
+
+	// the display itself starts on a whole framebuffer pixel
+	float origin_x = roundf((gfxs->w - gfxs->gfx_w * scale) / 2)
+		- gfxs->boarder_sz * scale;
+	float origin_y = roundf((gfxs->h - gfxs->gfx_h * scale) / 2)
+		- gfxs->boarder_sz * scale;
+
+	// x and y scale, then x and y offset, y points down in chip8 pixels
+	float transform[4] = {
+		2.0f * scale / gfxs->w,
+		-2.0f * scale / gfxs->h,
+		2.0f * origin_x / gfxs->w - 1.0f,
+		1.0f - 2.0f * origin_y / gfxs->h
+	};
+
+	glViewport(0, 0, gfxs->w, gfxs->h);
+	set_transform(gfxs->tex_program, transform);
+	set_transform(gfxs->program, transform);
+	gfxs->resize_pending = false;
+}
+
+static void set_transform(unsigned program, const float transform[4])
+{
+	glUseProgram(program);
+	glUniform4fv(glGetUniformLocation(program, "transform"), 1, transform);
+}
+
+// one unit per chip8 pixel, offset by the boarder
+static void generate_vertices(GFXscreen gfxs)
+{
+	float boarder_sz = gfxs->boarder_sz;
 
 	size_t vertices_iter;
 	for (size_t i = 0; i < gfxs->gfx_h; ++i) {
@@ -346,25 +814,17 @@ static void generate_vertices(GFXscreen gfxs, unsigned boarder_thickns)
 			vertices_iter = i * gfxs->gfx_w * 4 * 2 + j * 4 * 2;
 
 			// top left vertex
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * j + boarder_thickns;            // x
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * i + boarder_thickns;            // y
+			gfxs->vertices[vertices_iter++] = j + boarder_sz;		// x
+			gfxs->vertices[vertices_iter++] = i + boarder_sz;		// y
 			// top right vertex
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * j + pixel_sz + boarder_thickns; // x
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * i + boarder_thickns;			   // y
+			gfxs->vertices[vertices_iter++] = j + 1 + boarder_sz;	// x
+			gfxs->vertices[vertices_iter++] = i + boarder_sz;		// y
 			// bottom left vertex
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * j + boarder_thickns;			   // x
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * i + pixel_sz + boarder_thickns; // y
+			gfxs->vertices[vertices_iter++] = j + boarder_sz;		// x
+			gfxs->vertices[vertices_iter++] = i + 1 + boarder_sz;	// y
 			// bottom right vertex
-			gfxs->vertices[vertices_iter++] =
-				pixel_sz * j + pixel_sz + boarder_thickns; // x
-			gfxs->vertices[vertices_iter  ] =
-				pixel_sz * i + pixel_sz + boarder_thickns; // y
+			gfxs->vertices[vertices_iter++] = j + 1 + boarder_sz;	// x
+			gfxs->vertices[vertices_iter  ] = i + 1 + boarder_sz;	// y
 		}
 	}
 }
@@ -414,50 +874,103 @@ static void create_element_array_buffer(GFXscreen gfxs)
 		gfxs->indices, GL_STATIC_DRAW);
 }
 
-static struct Boarder* create_boarder(unsigned w, unsigned h, unsigned thickns,
-	long color)
+/*
+ * same units as generate_vertices, the quad spans the boarder too and texel
+ * coordinates outside the display are drawn as boarder by the shader
+ */
+static void generate_quad_vertices(GFXscreen gfxs)
 {
-	struct Boarder *boarder = (struct Boarder*)malloc(sizeof(struct Boarder));
-	if (!boarder)
-		exit_log(FNAME, 1, "Failed creating Boarder, memory allocation fail.");
-
-	boarder->width = thickns;
-
-	// 4 vertices per edge (tl, tr, bl, br), 2 coordinates per vertex (x, y)
-	boarder->vertices_sz = 4 * 4 * 2;
-	boarder->vertices = (float*)malloc(sizeof(float) * boarder->vertices_sz);
-	if (!boarder->vertices)
-		exit_log(FNAME, 1, "Failed creating Boarder, memory allocation fail.");
-	generate_boarder_vertices(boarder, w, h, thickns);
+	float r = gfxs->gfx_w + gfxs->boarder_sz * 2;
+	float b = gfxs->gfx_h + gfxs->boarder_sz * 2;
+	float u0 = -gfxs->boarder_sz;
+	float v0 = -gfxs->boarder_sz;
+	float u1 = gfxs->gfx_w + gfxs->boarder_sz;
+	float v1 = gfxs->gfx_h + gfxs->boarder_sz;
+	float *iter = gfxs->quad_vertices;
+
+	*iter++ = 0.0f; *iter++ = 0.0f; *iter++ = u0; *iter++ = v0; // TL ver
+	*iter++ = r;    *iter++ = 0.0f; *iter++ = u1; *iter++ = v0; // TR ver
+	*iter++ = 0.0f; *iter++ = b;    *iter++ = u0; *iter++ = v1; // BL ver
+	*iter++ = r;    *iter++ = b;    *iter++ = u1; *iter++ = v1; // BR ver
+}
 
-	// 6 indices per edge (3 for tr triangle and 3 for bl triangle)
-	boarder->indices_sz = 4 * 6;
-	boarder->indices = 
-        (unsigned*)malloc(sizeof(unsigned) * boarder->indices_sz);
-	if (!boarder->indices)
-		exit_log(FNAME, 1, "Failed creating Boarder, memory allocation fail.");
-	generate_boarder_indices(boarder);
+// a single quad covering display and boarder, a 4 vertex triangle strip
+static void create_quad(GFXscreen gfxs)
+{
+	glGenVertexArrays(1, &gfxs->quad_vertex_array);
+	glBindVertexArray(gfxs->quad_vertex_array);
+
+	glGenBuffers(1, &gfxs->quad_array_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, gfxs->quad_array_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(gfxs->quad_vertices),
+		gfxs->quad_vertices, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, NULL);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4,
+		(void*)(sizeof(float) * 2));
+	glEnableVertexAttribArray(1);
+}
 
-	// 4 vertices per edge (tl, tr, bl, br), 3 colors per vertex (r, g, b)
-	boarder->colors_sz = 4 * 4 * 3;
-	boarder->colors = (float*)malloc(sizeof(float) * boarder->colors_sz);
-	if (!boarder->colors)
-		exit_log(FNAME, 1, "Failed creating Boarder, memory allocation fail.");
-	generate_boarder_colors(boarder, color);
+/*
+ * one unsigned byte per chip8 pixel, uploaded straight from gfx, the
+ * fragment shader fetches texels by integer coordinate so no filtering
+ * or normalization takes place
+ */
+static void create_texture(GFXscreen gfxs)
+{
+	glGenTextures(1, &gfxs->texture);
+	glBindTexture(GL_TEXTURE_2D, gfxs->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, gfxs->gfx_w, gfxs->gfx_h, 0,
+		GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+
+	glUseProgram(gfxs->tex_program);
+	glUniform1i(glGetUniformLocation(gfxs->tex_program, "screen"), 0);
+	glUniform1ui(glGetUniformLocation(gfxs->tex_program, "boarder_color"),
+		GFXSCREEN_PALETTE_ON);
+	glUseProgram(gfxs->program);
+}
 
-	create_boarder_vertex_array(boarder);
-	boarder->array_buffer_pos = 0;
-	create_boarder_array_buffer_pos(boarder);
-	create_boarder_element_array_buffer(boarder);
-	create_boarder_array_buffer_col(boarder);
+/*
+ * the palette lives in a uniform buffer bound to both programs, so changing a
+ * color is a single small buffer update, entries past on and off start black
+ */
+static void create_palette_buffer(GFXscreen gfxs, long color_on,
+	long color_off)
+{
+	glGenBuffers(1, &gfxs->palette_buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, gfxs->palette_buffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(gfxs->palette), NULL,
+		GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, PALETTE_BINDING, gfxs->palette_buffer);
+	bind_palette_block(gfxs->program);
+	bind_palette_block(gfxs->tex_program);
+
+	memset(gfxs->palette, 0, sizeof(gfxs->palette));
+	for (size_t i = 0; i < GFXSCREEN_PALETTE_SZ; ++i)
+		gfxs->palette[i * 4 + 3] = 1.0f;
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(gfxs->palette),
+		gfxs->palette);
+	GFXscreen_set_palette_color(gfxs, GFXSCREEN_PALETTE_OFF, color_off);
+	GFXscreen_set_palette_color(gfxs, GFXSCREEN_PALETTE_ON, color_on);
+}
 
-	return boarder;
+static void bind_palette_block(unsigned program)
+{
+	glUniformBlockBinding(program,
+		glGetUniformBlockIndex(program, "Palette"), PALETTE_BINDING);
 }
 
-static void generate_boarder_vertices(struct Boarder *boarder, unsigned w,
-	unsigned h, unsigned thickns)
+// edges of the boarder in the same units as generate_vertices
+static void generate_boarder_vertices(GFXscreen gfxs)
 {
-	float *iter = boarder->vertices;
+	float thickns = gfxs->boarder_sz;
+	float w = gfxs->gfx_w + thickns * 2;
+	float h = gfxs->gfx_h + thickns * 2;
+	float *iter = gfxs->vertices + gfxs->gfx_w * gfxs->gfx_h * 4 * 2;
 
 	// top boarder
 	*iter++ = 0.0f;	       *iter++ = 0.0f;        // TL ver
@@ -481,75 +994,59 @@ static void generate_boarder_vertices(struct Boarder *boarder, unsigned w,
 	*iter++ = thickns;     *iter++ = h;           // BR ver
 }
 
-static void generate_boarder_indices(struct Boarder *boarder)
+static void generate_boarder_indices(GFXscreen gfxs)
 {
-	for (size_t i = 0; i < boarder->indices_sz;) {
+	unsigned first = gfxs->gfx_w * gfxs->gfx_h * 4;
+	unsigned *indices = gfxs->indices + gfxs->gfx_w * gfxs->gfx_h * 6;
+
+	for (size_t i = 0; i < BOARDER_INDICES;) {
 		// top right triangle
-		boarder->indices[i] = i / 6 * 4;
+		indices[i] = first + i / 6 * 4;
         ++i;
-		boarder->indices[i] = i / 6 * 4 + 1;
+		indices[i] = first + i / 6 * 4 + 1;
         ++i;
-		boarder->indices[i] = i / 6 * 4 + 3;
+		indices[i] = first + i / 6 * 4 + 3;
         ++i;
 		// bottom left triangle
-		boarder->indices[i] = i / 6 * 4;
+		indices[i] = first + i / 6 * 4;
         ++i;
-		boarder->indices[i] = i / 6 * 4 + 2;
+		indices[i] = first + i / 6 * 4 + 2;
         ++i;
-		boarder->indices[i] = i / 6 * 4 + 3;
+		indices[i] = first + i / 6 * 4 + 3;
         ++i;
 	}
 }
 
-static void generate_boarder_colors(struct Boarder *boarder, long color)
-{
-	for (size_t i = 0; i < boarder->colors_sz;) {
-		boarder->colors[i++] = (color & 0xFF0000) >> 16; // r
-		boarder->colors[i++] = (color & 0x00FF00) >> 8;  // g
-		boarder->colors[i++] = color & 0x0000FF;         // b
-	}
-}
-
-static void create_boarder_vertex_array(struct Boarder *boarder)
-{
-	glGenVertexArrays(1, &boarder->vertex_array);
-	glBindVertexArray(boarder->vertex_array);
-}
-
-static void create_boarder_array_buffer_pos(struct Boarder *boarder)
-{
-	if(!boarder->array_buffer_pos)
-		glGenBuffers(1, &boarder->array_buffer_pos);
-
-	glBindBuffer(GL_ARRAY_BUFFER, boarder->array_buffer_pos);
-	glBufferData(GL_ARRAY_BUFFER, boarder->vertices_sz * sizeof(float),
-		boarder->vertices, GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-	glEnableVertexAttribArray(0);
-}
-
-static void create_boarder_element_array_buffer(struct Boarder *boarder)
+bool GFXscreen_window_close(GFXscreen gfxs)
 {
-	glGenBuffers(1, &boarder->element_array_buffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, boarder->element_array_buffer);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-		boarder->indices_sz * sizeof(unsigned), boarder->indices,
-		GL_STATIC_DRAW);
+	return gfxs->window_close;
 }
 
-static void create_boarder_array_buffer_col(struct Boarder *boarder)
+/*
+ * brings a hidden window back for another session, a close requested during
+ * the last one is forgotten and the whole display is uploaded again since
+ * the caller's gfx may have changed in between
+ */
+void GFXscreen_show(GFXscreen gfxs)
 {
-	glGenBuffers(1, &boarder->array_buffer_col);
-	glBindBuffer(GL_ARRAY_BUFFER, boarder->array_buffer_col);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * boarder->colors_sz,
-		boarder->colors, GL_STATIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-	glEnableVertexAttribArray(1);
+	glfwSetWindowShouldClose(gfxs->win, 0);
+	gfxs->window_close = false;
+	gfxs->full_upload = true;
+	// changes from the last session, hide released whatever was held
+	gfxs->keypad = 0;
+	gfxs->key_events_count = 0;
+	gfxs->keypad_taken = 0;
+	gfxs->key_events_dropped = 0.0;
+	glfwShowWindow(gfxs->win);
+	glfwFocusWindow(gfxs->win);
 }
 
-bool GFXscreen_window_close(GFXscreen gfxs)
+// the window and every GL object stay alive, ready for GFXscreen_show
+void GFXscreen_hide(GFXscreen gfxs)
 {
-	return gfxs->window_close;
+	glfwHideWindow(gfxs->win);
+	// deliver the hide and let go of keys held when it happened
+	glfwPollEvents();
 }
 
 void GFXscreen_map_keypad_keyboard(GFXscreen gfxs, unsigned keypad,
@@ -579,129 +1076,376 @@ void GFXscreen_map_keypad_keyboard(GFXscreen gfxs, unsigned keypad,
 		exit_log(FNAME, 1, "Failed mapping keypad button, unsupported key.",
 			keyboard_str);
 	}
-	
-	map_add(gfxs->keypad_keyboard_map, keypad, keyboard);
-	map_add(gfxs->keypad_state_map, keypad, 0);
+	if (keypad >= GFXSCREEN_KEYPAD_SZ)
+		exit_log(FNAME, 1, "Failed mapping keypad button, keypad out of range.");
+
+	// printable GLFW_KEY_X values are their ascii characters
+	gfxs->key_to_keypad[(unsigned char)keyboard] = (signed char)keypad;
 }
 
+// once per host frame, key changes arrive through key_cback meanwhile
 void GFXscreen_process_input(GFXscreen gfxs)
 {
 	glfwPollEvents();
 
 	if (glfwWindowShouldClose(gfxs->win))
 		gfxs->window_close = true;
+}
 
-	if (glfwGetKey(gfxs->win, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-		glfwSetWindowShouldClose(gfxs->win, 1);
-
-	const int *keys = map_get_keys(gfxs->keypad_keyboard_map);
-	for (size_t i = 0; i < map_get_size(gfxs->keypad_keyboard_map); ++i)
-		if (
-			glfwGetKey(gfxs->win, map_get(gfxs->keypad_keyboard_map, keys[i]))
-			==
-			GLFW_PRESS
-		)
-			map_set(gfxs->keypad_state_map, keys[i], 1);
-		else
-			map_set(gfxs->keypad_state_map, keys[i], 0);
+uint16_t GFXscreen_get_keypad(GFXscreen gfxs)
+{
+	return gfxs->keypad;
+}
+
+bool GFXscreen_next_key_event(GFXscreen gfxs, GFXscreen_key_event *event)
+{
+	if (!gfxs->key_events_count && !resync_key_events(gfxs))
+		return false;
+
+	*event = gfxs->key_events[gfxs->key_events_head];
+	gfxs->key_events_head = (gfxs->key_events_head + 1) % KEY_EVENTS_SZ;
+	--gfxs->key_events_count;
+	if (event->pressed)
+		gfxs->keypad_taken |= 1u << event->keypad;
+	else
+		gfxs->keypad_taken &= ~(1u << event->keypad);
+	return true;
+}
+
+// true while the rewind hotkey (backspace) is held down
+bool GFXscreen_rewind_held(GFXscreen gfxs)
+{
+	return gfxs->rewind_held;
+}
+
+void GFXscreen_set_palette_color(GFXscreen gfxs, unsigned index, long color)
+{
+	if (index >= GFXSCREEN_PALETTE_SZ)
+		exit_log(FNAME, 1, "Failed setting palette color, index out of range.");
+
+	float *entry = gfxs->palette + index * 4;
+	entry[0] = ((color & 0xFF0000) >> 16) / 255.0f; // r
+	entry[1] = ((color & 0x00FF00) >> 8) / 255.0f;  // g
+	entry[2] = (color & 0x0000FF) / 255.0f;         // b
+
+	glBindBuffer(GL_UNIFORM_BUFFER, gfxs->palette_buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, sizeof(float) * index * 4,
+		sizeof(float) * 4, entry);
 }
 
-const Map GFXscreen_get_keypad_state_map(GFXscreen gfxs)
+void GFXscreen_set_present_mode(GFXscreen gfxs, GFXscreen_present mode)
 {
-	return gfxs->keypad_state_map;
+	int interval = 0;
+	unsigned hz = PACER_UNCAPPED;
+
+	switch (mode) {
+	case GFXSCREEN_PRESENT_PACED:
+		hz = gfxs->fps;
+		break;
+	case GFXSCREEN_PRESENT_UNCAPPED:
+		break;
+	case GFXSCREEN_PRESENT_VSYNC:
+		interval = 1;
+		break;
+	case GFXSCREEN_PRESENT_ADAPTIVE:
+		// a negative interval lets late frames tear, where supported
+		interval = glfwExtensionSupported("WGL_EXT_swap_control_tear")
+			|| glfwExtensionSupported("GLX_EXT_swap_control_tear") ? -1 : 1;
+		break;
+	case GFXSCREEN_PRESENT_LATE:
+		interval = 1;
+		hz = glfwGetVideoMode(glfwGetPrimaryMonitor())->refreshRate;
+		break;
+	}
+
+	glfwSwapInterval(interval);
+	pacer_set_hz(gfxs->pacer, hz);
+	gfxs->present_mode = mode;
 }
 
-void GFXscreen_draw_frame(GFXscreen gfxs, const unsigned char gfx[])
+void GFXscreen_mark_input(GFXscreen gfxs, double time)
+{
+	pacer_mark_input(gfxs->pacer, time);
+}
+
+double GFXscreen_get_late_wake(GFXscreen gfxs)
+{
+	if (gfxs->present_mode != GFXSCREEN_PRESENT_LATE)
+		return 0.0;
+	return pacer_late_wake(gfxs->pacer);
+}
+
+double GFXscreen_get_latency(GFXscreen gfxs)
+{
+	return pacer_get_latency(gfxs->pacer);
+}
+
+// takes effect at the next frame
+void GFXscreen_set_integer_scaling(GFXscreen gfxs, bool enabled)
+{
+	gfxs->integer_scaling = enabled;
+	gfxs->resize_pending = true;
+}
+
+// the newly selected path has stale data, so the next frame uploads it all
+void GFXscreen_set_renderer(GFXscreen gfxs, GFXscreen_renderer renderer)
+{
+	if (renderer != gfxs->renderer)
+		gfxs->full_upload = true;
+	gfxs->renderer = renderer;
+}
+
+void GFXscreen_draw_frame(GFXscreen gfxs, const unsigned char gfx[],
+	uint64_t dirty_rows)
 {
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	glBindVertexArray(gfxs->vertex_array);
-	generate_colors(gfxs, gfx);
-	create_array_buffer_col(gfxs);
-	glDrawElements(GL_TRIANGLES, gfxs->indices_sz, GL_UNSIGNED_INT, NULL);
+	if (gfxs->resize_pending)
+		update_transform(gfxs);
 
-	glBindVertexArray(gfxs->boarder->vertex_array);
-	glDrawElements(GL_TRIANGLES, gfxs->boarder->indices_sz, GL_UNSIGNED_INT,
-		NULL);
+	if (gfxs->full_upload) {
+		dirty_rows = GFXSCREEN_ALL_ROWS;
+		gfxs->full_upload = false;
+	}
 
-	glfwSwapBuffers(gfxs->win);
+	// display and boarder go out in a single draw
+	if (gfxs->renderer == GFXSCREEN_RENDER_TEXTURE) {
+		update_texture(gfxs, gfx, dirty_rows);
+		glUseProgram(gfxs->tex_program);
+		glBindVertexArray(gfxs->quad_vertex_array);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+	else {
+		update_array_buffer_col(gfxs, gfx, dirty_rows);
+		glUseProgram(gfxs->program);
+		glBindVertexArray(gfxs->vertex_array);
+		glDrawElements(GL_TRIANGLES, gfxs->indices_sz, GL_UNSIGNED_INT, NULL);
+	}
+	stream_end(gfxs->stream);
 
-	// synchronize the frame rate
-    double frame_duration = 1000.0 / gfxs->fps / 1000.0;
-	while (glfwGetTime() - gfxs->prev_frame < frame_duration)
-        ;
-	gfxs->prev_frame = glfwGetTime();
+	double submit = get_time();
+	glfwSwapBuffers(gfxs->win);
+	// the swap may return before the flip, the vblank estimate needs the flip
+	if (gfxs->present_mode == GFXSCREEN_PRESENT_LATE)
+		glFinish();
+	pacer_present(gfxs->pacer, submit, get_time());
+
+	// synchronize the frame rate, vsync modes are paced by the swap itself
+	if (gfxs->present_mode == GFXSCREEN_PRESENT_PACED)
+		pacer_wait(gfxs->pacer);
+	else if (gfxs->present_mode == GFXSCREEN_PRESENT_LATE)
+		pacer_wait_late(gfxs->pacer);
 }
 
-static void generate_colors(GFXscreen gfxs, const unsigned char gfx[])
+// gfx values are palette indices already, each is repeated for 4 vertices
+static void generate_row_colors(GFXscreen gfxs, const unsigned char gfx[],
+	size_t row, unsigned char *colors)
 {
-	long color;
-	size_t colors_iter;
-	for (size_t i = 0; i < gfxs->gfx_h; ++i) {
-		for (size_t j = 0; j < gfxs->gfx_w; ++j) {
-			color = gfx[i * gfxs->gfx_w + j] ? gfxs->color_on : gfxs->color_off;
-			colors_iter = i * gfxs->gfx_w * 4 * 3 + j * 4 * 3;
-
-			// top left vertex
-			gfxs->colors[colors_iter++] = ((color & 0xFF0000) >> 16) / 255.0;//r
-			gfxs->colors[colors_iter++] = ((color & 0x00FF00) >> 8) / 255.0; //g
-			gfxs->colors[colors_iter++] = (color & 0x0000FF) / 255.0f;		 //b
-			// top right vertex
-			gfxs->colors[colors_iter++] = ((color & 0xFF0000) >> 16) / 255.0;//r
-			gfxs->colors[colors_iter++] = ((color & 0x00FF00) >> 8) / 255.0; //g
-			gfxs->colors[colors_iter++] = (color & 0x0000FF) / 255.0;		 //b
-			// bottom left vertex
-			gfxs->colors[colors_iter++] = ((color & 0xFF0000) >> 16) / 255.0;//r
-			gfxs->colors[colors_iter++] = ((color & 0x00FF00) >> 8) / 255.0; //g
-			gfxs->colors[colors_iter++] = (color & 0x0000FF) / 255.0;		 //b
-			// bottom right vertex
-			gfxs->colors[colors_iter++] = ((color & 0xFF0000) >> 16) / 255.0;//r
-			gfxs->colors[colors_iter++] = ((color & 0x00FF00) >> 8) / 255.0; //g
-			gfxs->colors[colors_iter++] = (color & 0x0000FF) / 255.0;		 //b
-		}
+	const unsigned char *pixel = gfx + row * gfxs->gfx_w;
+	unsigned char *colors_iter = colors + row * gfxs->gfx_w * 4;
+	for (size_t j = 0; j < gfxs->gfx_w; ++j) {
+		memset(colors_iter, pixel[j], 4);
+		colors_iter += 4;
 	}
 }
 
+/*
+ * storage is allocated once, pixel rows are filled in by
+ * update_array_buffer_col and the boarder vertices after them are set here
+ */
 static void create_array_buffer_col(GFXscreen gfxs)
 {
-	if(!gfxs->array_buffer_col)
-		glGenBuffers(1, &gfxs->array_buffer_col);
+	unsigned char boarder_colors[BOARDER_VERTICES];
+	memset(boarder_colors, GFXSCREEN_PALETTE_ON, BOARDER_VERTICES);
 
+	glGenBuffers(1, &gfxs->array_buffer_col);
 	glBindBuffer(GL_ARRAY_BUFFER, gfxs->array_buffer_col);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * gfxs->colors_sz, gfxs->colors,
+	glBufferData(GL_ARRAY_BUFFER, gfxs->colors_sz + BOARDER_VERTICES, NULL,
 		GL_DYNAMIC_DRAW);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glBufferSubData(GL_ARRAY_BUFFER, gfxs->colors_sz, BOARDER_VERTICES,
+		boarder_colors);
+	glVertexAttribIPointer(1, 1, GL_UNSIGNED_BYTE, 0, NULL);
 	glEnableVertexAttribArray(1);
 }
 
+/*
+ * regenerates the palette indices of dirty rows only, straight into the
+ * stream, and copies them into the vertex buffer on the GPU, adjacent dirty
+ * rows go in a single copy and nothing is touched when no row changed
+ */
+static void update_array_buffer_col(GFXscreen gfxs, const unsigned char gfx[],
+	uint64_t dirty_rows)
+{
+	if (!dirty_rows)
+		return;
+
+	size_t row_sz = gfxs->gfx_w * 4;
+	unsigned char *colors = stream_begin(gfxs->stream, GL_COPY_READ_BUFFER);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, gfxs->array_buffer_col);
+	for (size_t row = 0; row < gfxs->gfx_h;) {
+		if (!ROW_DIRTY(dirty_rows, row)) {
+			++row;
+			continue;
+		}
+
+		size_t first = row;
+		while (row < gfxs->gfx_h && ROW_DIRTY(dirty_rows, row))
+			generate_row_colors(gfxs, gfx, row++, colors);
+		stream_flush(gfxs->stream, GL_COPY_READ_BUFFER, first * row_sz,
+			(row - first) * row_sz);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+			gfxs->stream->base + first * row_sz, first * row_sz,
+			(row - first) * row_sz);
+	}
+}
+
+/*
+ * same run coalescing as update_array_buffer_col, gfx rows are copied into
+ * the stream unchanged and the texture is updated from it as an unpack buffer
+ */
+static void update_texture(GFXscreen gfxs, const unsigned char gfx[],
+	uint64_t dirty_rows)
+{
+	if (!dirty_rows)
+		return;
+
+	unsigned char *texels = stream_begin(gfxs->stream, GL_PIXEL_UNPACK_BUFFER);
+	glBindTexture(GL_TEXTURE_2D, gfxs->texture);
+	for (size_t row = 0; row < gfxs->gfx_h;) {
+		if (!ROW_DIRTY(dirty_rows, row)) {
+			++row;
+			continue;
+		}
+
+		size_t first = row;
+		while (row < gfxs->gfx_h && ROW_DIRTY(dirty_rows, row))
+			++row;
+
+		size_t offset = first * gfxs->gfx_w;
+		size_t len = (row - first) * gfxs->gfx_w;
+		memcpy(texels + offset, gfx + offset, len);
+		stream_flush(gfxs->stream, GL_PIXEL_UNPACK_BUFFER, offset, len);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, gfxs->gfx_w, row - first,
+			GL_RED_INTEGER, GL_UNSIGNED_BYTE,
+			(void*)(gfxs->stream->base + offset));
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
 void GFXscreen_destroy(GFXscreen gfxs)
 {
-	destroy_boarder(gfxs->boarder);
+	pacer_destroy(gfxs->pacer);
+	destroy_stream(gfxs->stream);
+	glDeleteTextures(1, &gfxs->texture);
+	glDeleteBuffers(1, &gfxs->quad_array_buffer);
+	glDeleteVertexArrays(1, &gfxs->quad_vertex_array);
 	glDeleteBuffers(1, &gfxs->array_buffer_col);
-	free(gfxs->colors);
-	map_destroy(gfxs->keypad_state_map);
-	map_destroy(gfxs->keypad_keyboard_map);
+	glDeleteBuffers(1, &gfxs->palette_buffer);
 	glDeleteBuffers(1, &gfxs->element_array_buffer);
 	glDeleteBuffers(1, &gfxs->array_buffer_pos);
 	glDeleteVertexArrays(1, &gfxs->vertex_array);
-	free(gfxs->indices);
-	free(gfxs->vertices);
+	glDeleteProgram(gfxs->tex_program);
 	glDeleteProgram(gfxs->program);
 	glfwDestroyWindow(gfxs->win);
-	free(gfxs);
+	arena_destroy(gfxs->arena);
 	instance_exists = false;
 	active_instance = NULL;
 }
 
-static void destroy_boarder(struct Boarder *boarder)
+// staging is reserved in the arena either way, it's only used by the fallback
+static struct Stream* create_stream(Arena arena, size_t region_sz)
 {
-	glDeleteBuffers(1, &boarder->array_buffer_col);
-	glDeleteBuffers(1, &boarder->element_array_buffer);
-	glDeleteBuffers(1, &boarder->array_buffer_pos);
-	glDeleteVertexArrays(1, &boarder->vertex_array);
-	free(boarder->colors);
-	free(boarder->indices);
-	free(boarder->vertices);
-	free(boarder);
+	struct Stream *stream =
+		(struct Stream*)arena_alloc(arena, sizeof(struct Stream));
+	memset(stream, 0, sizeof(struct Stream));
+	unsigned char *staging = (unsigned char*)arena_alloc(arena, region_sz);
+
+	stream->region_sz = region_sz;
+	glGenBuffers(1, &stream->buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, stream->buffer);
+
+	if (buffer_storage) {
+		GLbitfield flags =
+			GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		buffer_storage(GL_COPY_WRITE_BUFFER, region_sz * STREAM_REGIONS, NULL,
+			flags);
+		stream->mapped = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER,
+			0, region_sz * STREAM_REGIONS, flags);
+		if (stream->mapped)
+			return stream;
+
+		// immutable storage can not be respecified, start over with a new name
+		glDeleteBuffers(1, &stream->buffer);
+		glGenBuffers(1, &stream->buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, stream->buffer);
+	}
+
+	glBufferData(GL_COPY_WRITE_BUFFER, region_sz, NULL, GL_STREAM_DRAW);
+	stream->staging = staging;
+	return stream;
+}
+
+/*
+ * binds the stream to target and returns where this frame's data goes, the
+ * fence wait only blocks when the GPU is STREAM_REGIONS frames behind
+ */
+static unsigned char* stream_begin(struct Stream *stream, GLenum target)
+{
+	glBindBuffer(target, stream->buffer);
+	stream->pending = true;
+
+	if (!stream->mapped) {
+		// orphan the storage the GPU may still read from
+		glBufferData(target, stream->region_sz, NULL, GL_STREAM_DRAW);
+		stream->base = 0;
+		return stream->staging;
+	}
+
+	GLsync fence = stream->fences[stream->region];
+	if (fence) {
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+			STREAM_WAIT_NS) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(fence);
+		stream->fences[stream->region] = NULL;
+	}
+	stream->base = stream->region * stream->region_sz;
+	return stream->mapped + stream->base;
+}
+
+// makes len bytes at offset of this frame's data visible to the GPU
+static void stream_flush(struct Stream *stream, GLenum target, size_t offset,
+	size_t len)
+{
+	// coherent mappings need no flush
+	if (stream->mapped)
+		return;
+	glBufferSubData(target, offset, len, stream->staging + offset);
+}
+
+// call once the commands reading this frame's data have been issued
+static void stream_end(struct Stream *stream)
+{
+	if (!stream->pending)
+		return;
+	stream->pending = false;
+
+	if (stream->mapped) {
+		stream->fences[stream->region] =
+			glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		stream->region = (stream->region + 1) % STREAM_REGIONS;
+	}
+}
+
+static void destroy_stream(struct Stream *stream)
+{
+	for (size_t i = 0; i < STREAM_REGIONS; ++i)
+		if (stream->fences[i])
+			glDeleteSync(stream->fences[i]);
+	if (stream->mapped) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, stream->buffer);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+	}
+	glDeleteBuffers(1, &stream->buffer);
 }
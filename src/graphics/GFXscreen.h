@@ -3,12 +3,40 @@
 
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "../utility/utility.h"
 
 
 typedef struct GFXscreen_t* GFXscreen;
 
+// must match the Palette uniform block of the shaders
+#define GFXSCREEN_PALETTE_SZ 16
+// gfx values are palette indices, a plain chip8 display only uses these two
+#define GFXSCREEN_PALETTE_OFF 0
+#define GFXSCREEN_PALETTE_ON 1
+
+#define GFXSCREEN_KEYPAD_SZ 16
+
+typedef enum {
+	GFXSCREEN_RENDER_MESH,		// one quad per pixel, palette index per vertex
+	GFXSCREEN_RENDER_TEXTURE	// one quad sampling a gfx_w x gfx_h texture
+} GFXscreen_renderer;
+
+typedef enum {
+	GFXSCREEN_PRESENT_PACED,	// no vsync, frames limited to fps by a pacer
+	GFXSCREEN_PRESENT_UNCAPPED,	// no vsync, no limit
+	GFXSCREEN_PRESENT_VSYNC,	// every swap waits for vblank
+	GFXSCREEN_PRESENT_ADAPTIVE,	// vsync, late frames tear instead of waiting
+	GFXSCREEN_PRESENT_LATE		// vsync, frame loop woken just before vblank
+} GFXscreen_present;
+
+typedef struct {
+	unsigned char keypad;	// keypad key, 0 to GFXSCREEN_KEYPAD_SZ - 1
+	bool pressed;
+	double time;			// get_time() when the event reached the window
+} GFXscreen_key_event;
+
 
 GFXscreen GFXscreen_create(unsigned w, unsigned h, const char *title,
 	unsigned gfx_w, unsigned gfx_h, long color_on, long color_off,
@@ -16,14 +44,60 @@ GFXscreen GFXscreen_create(unsigned w, unsigned h, const char *title,
 
 bool GFXscreen_window_close(GFXscreen gfxs);
 
+// a closed window can be hidden and shown again without recreating it
+void GFXscreen_show(GFXscreen gfxs);
+
+void GFXscreen_hide(GFXscreen gfxs);
+
 void GFXscreen_map_keypad_keyboard(GFXscreen gfxs, unsigned keypad,
 	char keyboard);
 
 void GFXscreen_process_input(GFXscreen gfxs);
 
-const Map GFXscreen_get_keypad_state_map(GFXscreen gfxs);
+// bit k is set while keypad key k is held
+uint16_t GFXscreen_get_keypad(GFXscreen gfxs);
+
+/*
+ * oldest keypad change not taken yet, in the order they happened, changes the
+ * event ring had no room for are made up once it drains so the keys taken
+ * end up matching GFXscreen_get_keypad
+ */
+bool GFXscreen_next_key_event(GFXscreen gfxs, GFXscreen_key_event *event);
+
+bool GFXscreen_rewind_held(GFXscreen gfxs);
+
+// color_on and color_off passed to GFXscreen_create seed entries on and off
+void GFXscreen_set_palette_color(GFXscreen gfxs, unsigned index, long color);
+
+// GFXSCREEN_PRESENT_PACED is the default, setting one restarts the latency
+void GFXscreen_set_present_mode(GFXscreen gfxs, GFXscreen_present mode);
+
+/*
+ * the next drawn frame is the first to show the key event that reached the
+ * window at time, a GFXscreen_key_event time
+ */
+void GFXscreen_mark_input(GFXscreen gfxs, double time);
+
+/*
+ * in GFXSCREEN_PRESENT_LATE, when GFXscreen_draw_frame wakes to let the next
+ * frame sample input, 0 in every other mode
+ */
+double GFXscreen_get_late_wake(GFXscreen gfxs);
+
+// smoothed seconds from a marked key event to the end of its frame's swap
+double GFXscreen_get_latency(GFXscreen gfxs);
+
+// off by default, the display then fills as much of the window as it can
+void GFXscreen_set_integer_scaling(GFXscreen gfxs, bool enabled);
+
+// GFXSCREEN_RENDER_TEXTURE is the default
+void GFXscreen_set_renderer(GFXscreen gfxs, GFXscreen_renderer renderer);
+
+#define GFXSCREEN_ALL_ROWS UINT64_MAX
 
-void GFXscreen_draw_frame(GFXscreen gfxs, const unsigned char gfx[]);
+// dirty_rows has bit i set when row i of gfx changed since the last frame
+void GFXscreen_draw_frame(GFXscreen gfxs, const unsigned char gfx[],
+	uint64_t dirty_rows);
 
 void GFXscreen_destroy(GFXscreen gfxs);
 
@@ -0,0 +1,25 @@
+#version 400 core
+
+// texture coordinates are in texels, one texel per chip8 pixel
+in vec2 vert_tex_coords;
+
+uniform usampler2D screen;
+// palette index of texels outside the display
+uniform uint boarder_color;
+
+layout (std140) uniform Palette {
+	vec4 colors[16];
+} palette;
+
+out vec3 frag_color;
+
+void main()
+{
+	// flooring to the containing texel gives nearest neighbour scaling
+	ivec2 texel = ivec2(floor(vert_tex_coords));
+	if (any(lessThan(texel, ivec2(0)))
+		|| any(greaterThanEqual(texel, textureSize(screen, 0))))
+		frag_color = palette.colors[boarder_color].rgb;
+	else
+		frag_color = palette.colors[texelFetch(screen, texel, 0).r].rgb;
+}
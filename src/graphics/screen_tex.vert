@@ -0,0 +1,15 @@
+#version 400 core
+
+layout (location = 0) in vec2 prog_pos_coords;
+layout (location = 1) in vec2 prog_tex_coords;
+
+// chip8 pixels to clip space, xy scale then zw offset
+uniform vec4 transform;
+
+out vec2 vert_tex_coords;
+
+void main()
+{
+	gl_Position = vec4(prog_pos_coords * transform.xy + transform.zw, 0.0, 1.0);
+	vert_tex_coords = prog_tex_coords;
+}
@@ -1,14 +1,19 @@
 #version 400 core
 
 layout (location = 0) in vec2 prog_pos_coords;
-layout (location = 1) in vec3 prog_color;
+layout (location = 1) in uint prog_palette_index;
 
-uniform mat4 ortho;
+// chip8 pixels to clip space, xy scale then zw offset
+uniform vec4 transform;
+
+layout (std140) uniform Palette {
+	vec4 colors[16];
+} palette;
 
 out vec3 vert_color;
 
 void main()
 {
-	gl_Position = ortho * vec4(prog_pos_coords, 0.0, 1.0);
-	vert_color = prog_color;
+	gl_Position = vec4(prog_pos_coords * transform.xy + transform.zw, 0.0, 1.0);
+	vert_color = palette.colors[prog_palette_index].rgb;
 }
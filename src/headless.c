@@ -0,0 +1,280 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Chip8/Chip8.h"
+#include "utility/utility.h"
+
+
+/*
+ * chip8-headless, runs a ROM without a window or GL context and reports how
+ * fast it ran along with hashes of where it ended up, for batch runs and
+ * regression checks on machines without a GPU, ips only counts executed
+ * instructions, cycles idled on fx0a are reported as blocked
+ *
+ *	chip8-headless <rom> [--frames N | --cycles N] [--ips N] [--seed N]
+ *		[--interpreter plain|cached] [--input <script>]
+ *
+ * an input script has one "<frame> <key> <pressed>" line per keypad change,
+ * key in hex, pressed 1 or 0, lines sorted by frame, '#' starts a comment
+ */
+
+
+#define FNAME "headless.c"
+#define FRAME_HZ 60
+#define DEFAULT_FRAMES 600
+// fixed so two runs of the same ROM and script hash the same
+#define DEFAULT_SEED 1
+#define INPUT_LINE_SZ 256
+// cycles per chip8_run_cycles call, its count is an unsigned long
+#define CYCLES_CHUNK 0x100000ul
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+
+struct Key_change {
+	unsigned long long frame;
+	unsigned key;
+	bool pressed;
+};
+
+struct Script {
+	struct Key_change *changes;
+	size_t size;
+	size_t next;
+};
+
+struct Options {
+	const char *rom;
+	const char *input;
+	unsigned long long frames;
+	unsigned long long cycles;	// 0 to run frames instead
+	unsigned ips;
+	unsigned long seed;
+	Chip8_interpreter interpreter;
+};
+
+
+void parse_options(int argc, char *argv[], struct Options *opts);
+unsigned long long parse_count(const char *arg);
+void load_script(const char *path, struct Script *script);
+void apply_script(struct Script *script, unsigned long long frame,
+	uint16_t *keys, uint16_t *pressed);
+void run_cycles(Chip8 c8, unsigned long long n, uint16_t keys,
+	uint16_t *pressed);
+uint64_t hash_bytes(uint64_t hash, const unsigned char *bytes, size_t len);
+
+
+int main(int argc, char *argv[])
+{
+	struct Options opts;
+	parse_options(argc, argv, &opts);
+
+	struct Script script = { NULL, 0, 0 };
+	if (opts.input)
+		load_script(opts.input, &script);
+
+	Chip8 c8 = chip8_create();
+	chip8_seed(c8, opts.seed);
+	chip8_set_interpreter(c8, opts.interpreter);
+	chip8_set_timers(c8, CHIP8_TIMERS_CYCLES, opts.ips);
+	chip8_load_program(c8, opts.rom);
+
+	uint16_t keys = 0;
+	uint16_t pressed = 0;
+	unsigned long long frame = 0;
+	double start = get_time();
+	for (;;) {
+		unsigned long long cycles = chip8_get_cycles(c8);
+		if (opts.cycles ? cycles >= opts.cycles : frame == opts.frames)
+			break;
+
+		/*
+		 * frame f ends at cycle (f + 1) * ips / FRAME_HZ, the same split
+		 * the scheduler makes, so fractional cycles per frame don't drift
+		 */
+		unsigned long long frame_end = (frame + 1) * opts.ips / FRAME_HZ;
+		if (opts.cycles && frame_end > opts.cycles)
+			frame_end = opts.cycles;
+
+		apply_script(&script, frame, &keys, &pressed);
+		if (frame_end > cycles)
+			run_cycles(c8, frame_end - cycles, keys, &pressed);
+		pressed = 0;
+		++frame;
+	}
+	double elapsed = get_time() - start;
+
+	unsigned char *snapshot = (unsigned char*)malloc(chip8_snapshot_size());
+	if (!snapshot)
+		exit_log(FNAME, 1, "Failed hashing state, memory allocation fail.");
+	size_t snapshot_sz = chip8_snapshot(c8, snapshot);
+
+	unsigned char rows[CHIP8_DISPLAY_HEIGHT * 8];
+	const uint64_t *gfx_rows = chip8_get_gfx_rows(c8);
+	for (size_t i = 0; i < CHIP8_DISPLAY_HEIGHT; ++i)
+		for (size_t j = 0; j < 8; ++j)
+			rows[i * 8 + j] = (unsigned char)(gfx_rows[i] >> j * 8);
+
+	unsigned long long cycles = chip8_get_cycles(c8);
+	unsigned long long executed = chip8_get_instructions(c8);
+	printf("rom         %s\n", opts.rom);
+	printf("interpreter %s\n",
+		opts.interpreter == CHIP8_INTERPRETER_CACHED ? "cached" : "plain");
+	printf("frames      %llu\n", frame);
+	printf("cycles      %llu\n", cycles);
+	printf("executed    %llu\n", executed);
+	printf("blocked     %llu\n", cycles - executed);
+	printf("seconds     %.6f\n", elapsed);
+	printf("ips         %.0f\n", elapsed > 0.0 ? executed / elapsed : 0.0);
+	printf("framebuffer %016llx\n",
+		(unsigned long long)hash_bytes(FNV_OFFSET, rows, sizeof(rows)));
+	printf("state       %016llx\n",
+		(unsigned long long)hash_bytes(FNV_OFFSET, snapshot, snapshot_sz));
+
+	free(snapshot);
+	free(script.changes);
+	chip8_destroy(c8);
+	return 0;
+}
+
+void parse_options(int argc, char *argv[], struct Options *opts)
+{
+	opts->rom = NULL;
+	opts->input = NULL;
+	opts->frames = DEFAULT_FRAMES;
+	opts->cycles = 0;
+	opts->ips = CHIP8_DEFAULT_IPS;
+	opts->seed = DEFAULT_SEED;
+	opts->interpreter = CHIP8_INTERPRETER_PLAIN;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (arg[0] != '-' || arg[1] != '-') {
+			opts->rom = arg;
+			continue;
+		}
+		if (i + 1 == argc)
+			exit_log(FNAME, 2, "Failed parsing options, missing value.", arg);
+
+		const char *value = argv[++i];
+		if (!strcmp(arg, "--frames"))
+			opts->frames = parse_count(value);
+		else if (!strcmp(arg, "--cycles"))
+			opts->cycles = parse_count(value);
+		else if (!strcmp(arg, "--ips"))
+			opts->ips = (unsigned)parse_count(value);
+		else if (!strcmp(arg, "--seed"))
+			opts->seed = (unsigned long)parse_count(value);
+		else if (!strcmp(arg, "--interpreter")) {
+			if (!strcmp(value, "plain"))
+				opts->interpreter = CHIP8_INTERPRETER_PLAIN;
+			else if (!strcmp(value, "cached"))
+				opts->interpreter = CHIP8_INTERPRETER_CACHED;
+			else
+				exit_log(FNAME, 2,
+					"Failed parsing options, interpreter is plain or cached.",
+					value);
+		}
+		else if (!strcmp(arg, "--input"))
+			opts->input = value;
+		else
+			exit_log(FNAME, 2, "Failed parsing options, unknown option.", arg);
+	}
+
+	if (!opts->rom)
+		exit_log(FNAME, 2, "Failed parsing options, no ROM given.",
+			"usage: chip8-headless <rom> [--frames N | --cycles N] [--ips N]"
+			" [--seed N] [--interpreter plain|cached] [--input <script>]");
+	if (!opts->ips)
+		exit_log(FNAME, 1, "Failed parsing options, ips must not be 0.");
+}
+
+unsigned long long parse_count(const char *arg)
+{
+	char *end;
+	unsigned long long count = strtoull(arg, &end, 10);
+	if (end == arg || *end)
+		exit_log(FNAME, 2, "Failed parsing options, not a number.", arg);
+	return count;
+}
+
+void load_script(const char *path, struct Script *script)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		exit_log(FNAME, 2, "Failed loading input script, bad path.", path);
+
+	size_t capacity = 0;
+	char line[INPUT_LINE_SZ];
+	while (fgets(line, INPUT_LINE_SZ, f)) {
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		struct Key_change change;
+		unsigned pressed;
+		int fields = sscanf(line, "%llu %x %u", &change.frame, &change.key,
+			&pressed);
+		// blank or comment only
+		if (fields == EOF)
+			continue;
+		if (fields != 3 || change.key >= 16)
+			exit_log(FNAME, 2, "Failed loading input script, bad line.", line);
+		change.pressed = pressed != 0;
+
+		if (script->size == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			struct Key_change *changes = (struct Key_change*)realloc(
+				script->changes, sizeof(struct Key_change) * capacity);
+			if (!changes)
+				exit_log(FNAME, 1,
+					"Failed loading input script, memory allocation fail.");
+			script->changes = changes;
+		}
+		script->changes[script->size++] = change;
+	}
+
+	fclose(f);
+}
+
+// applies every change due by frame, presses last the frame unless fx0a takes them
+void apply_script(struct Script *script, unsigned long long frame,
+	uint16_t *keys, uint16_t *pressed)
+{
+	while (script->next < script->size
+		&& script->changes[script->next].frame <= frame) {
+		const struct Key_change *change = script->changes + script->next++;
+		if (change->pressed) {
+			*keys |= 1u << change->key;
+			*pressed |= 1u << change->key;
+		}
+		else
+			*keys &= ~(1u << change->key);
+	}
+}
+
+// runs exactly n cycles, a wait on fx0a idles through the rest of them
+void run_cycles(Chip8 c8, unsigned long long n, uint16_t keys,
+	uint16_t *pressed)
+{
+	unsigned long long end = chip8_get_cycles(c8) + n;
+	unsigned long long now;
+	while ((now = chip8_get_cycles(c8)) < end) {
+		unsigned long budget = end - now > CYCLES_CHUNK
+			? CYCLES_CHUNK : (unsigned long)(end - now);
+		chip8_run_cycles(c8, budget, keys, pressed);
+	}
+}
+
+// FNV-1a
+uint64_t hash_bytes(uint64_t hash, const unsigned char *bytes, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
@@ -1,34 +1,124 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "Chip8/Chip8.h"
+#include "concurrency/Concurrency.h"
 #include "graphics/GFXscreen.h"
+#include "rewind/Rewind.h"
+#include "scheduler/Pacer.h"
+#include "scheduler/Scheduler.h"
+
+
+// guest instructions per second, SCHEDULER_UNCAPPED to run unthrottled
+#define INSTRUCTIONS_PER_SECOND 700
+// host presentation rate
+#define DISPLAY_HZ 60
+// how frames reach the screen at start up, menu entry 8 cycles through them
+#define PRESENT_MODE GFXSCREEN_PRESENT_PACED
+#define MENU_PRESENT 8
+// rewind history, about 60 s of typical delta compressed frames fit easily
+#define REWIND_BUFFER_SZ (4 * 1024 * 1024)
+// input events in flight from the window to the emulation thread
+#define INPUT_QUEUE_SZ 256
+
+
+enum {
+	INPUT_NONE,
+	INPUT_KEYPAD,
+	INPUT_REWIND
+};
+
+struct Input_event {
+	unsigned char type;
+	unsigned char key;
+	unsigned char pressed;
+	double time;			// GFXscreen_key_event time, 0 for rewind
+};
+
+// the display as published by the emulation thread
+struct Frame {
+	uint64_t rows[CHIP8_DISPLAY_HEIGHT];
+	// oldest key event the frame consumed, 0 if none, lost if never read
+	double input_time;
+};
+
+// shared by the window thread and the emulation thread
+struct Emulation {
+	Chip8 c8;
+	Triple_buffer frames;
+	Spsc_queue input;
+	// when the window next samples input in late present mode, 0 otherwise
+	_Atomic double late_wake;
+	atomic_bool running;
+};
+
+
+// indexed by GFXscreen_present
+static const char *const present_names[] = {
+	"paced", "uncapped", "vsync", "adaptive", "late"
+};
 
 
 void clear_screen(void);
-void print_menu(void);
+void print_menu(GFXscreen_present present, double latency);
 const char *parse_num_to_program(unsigned num);
 
-void run_emulator(const char *program);
+GFXscreen create_display(void);
+Chip8 create_chip8(void);
+double run_emulator(GFXscreen gfxs, Chip8 c8, const char *program,
+	GFXscreen_present present);
+void emulation_thread(void *arg);
+void run_frame(Chip8 c8, Scheduler sched, uint16_t keys, uint16_t *pressed);
+void send_input(Spsc_queue input, GFXscreen gfxs,
+	struct Input_event *unsent, bool *sent_rewind);
+uint64_t expand_frame(const struct Frame *frame, struct Frame *shown,
+	unsigned char gfx[]);
+void print_keybindings(void);
 void default_keypad_keyboard_mapping(GFXscreen gfxs);
 
 
 int main(void)
 {
+	// created by the first session and reused by every one after it
+	GFXscreen gfxs = NULL;
+	Chip8 c8 = NULL;
+	GFXscreen_present present = PRESENT_MODE;
+	// key to photon latency of the last session, 0 before one measured any
+	double latency = 0.0;
+
 	unsigned input;
 	for (;;) {
-		print_menu();
+		print_menu(present, latency);
 		
 		if (scanf("%d", &input) != 1)
 			continue;
-		if (input > 7)
+		if (input > MENU_PRESENT)
 			continue;
 		if (input == 0)
 			break;
+		if (input == MENU_PRESENT) {
+			present = (GFXscreen_present)((present + 1)
+				% (sizeof(present_names) / sizeof(*present_names)));
+			clear_screen();
+			continue;
+		}
 
-		run_emulator(parse_num_to_program(input));
+		if (!gfxs) {
+			gfxs = create_display();
+			c8 = create_chip8();
+		}
+		latency = run_emulator(gfxs, c8, parse_num_to_program(input),
+			present);
         clear_screen();
 	}
 
+	if (gfxs) {
+		chip8_destroy(c8);
+		GFXscreen_destroy(gfxs);
+	}
 	return 0;
 }
 
@@ -38,7 +128,7 @@ void clear_screen(void)
 		putchar('\n');
 }
 
-void print_menu(void)
+void print_menu(GFXscreen_present present, double latency)
 {
 	printf("----------------------------\n");
 	printf("CHIP-8\n");
@@ -50,6 +140,9 @@ void print_menu(void)
 	printf("[5] russian roulette\n");
 	printf("[6] soccer\n");
 	printf("[7] tank\n");
+	printf("\n[%d] present mode: %s\n", MENU_PRESENT, present_names[present]);
+	if (latency > 0.0)
+		printf("    last session key to photon: %.1f ms\n", latency * 1000.0);
 	
 	printf("\n[0] EXIT\n");
 	printf("----------------------------\n");
@@ -84,26 +177,222 @@ const char *parse_num_to_program(unsigned num)
 	return program;
 }
 
-void run_emulator(const char *program)
+GFXscreen create_display(void)
+{
+	GFXscreen gfxs = GFXscreen_create(1200, 800, "CHIP-8", CHIP8_DISPLAY_WIDTH,
+		CHIP8_DISPLAY_HEIGHT, 0xFFFFFF, 0x000000, DISPLAY_HZ, 10);
+	default_keypad_keyboard_mapping(gfxs);
+	return gfxs;
+}
+
+Chip8 create_chip8(void)
 {
 	Chip8 c8 = chip8_create();
+	if (INSTRUCTIONS_PER_SECOND == SCHEDULER_UNCAPPED)
+		chip8_set_timers(c8, CHIP8_TIMERS_WALLCLOCK, 0);
+	else
+		chip8_set_timers(c8, CHIP8_TIMERS_CYCLES, INSTRUCTIONS_PER_SECOND);
+	return c8;
+}
+
+/*
+ * loading the program resets the machine, the window is only shown again,
+ * returns the key to photon latency measured during the session
+ */
+double run_emulator(GFXscreen gfxs, Chip8 c8, const char *program,
+	GFXscreen_present present)
+{
 	chip8_load_program(c8, program);
+	print_keybindings();
+	// also starts a new latency measurement
+	GFXscreen_set_present_mode(gfxs, present);
+	GFXscreen_show(gfxs);
 
-	GFXscreen gfxs = GFXscreen_create(1200, 800, "CHIP-8", CHIP8_DISPLAY_WIDTH,
-		CHIP8_DISPLAY_HEIGHT, 0xFFFFFF, 0x000000, 500, 10);
-	default_keypad_keyboard_mapping(gfxs);
+	/*
+	 * the guest runs on its own thread so GL submission and swaps never slow
+	 * it down, input goes to it through a queue and frames come back through
+	 * a triple buffer
+	 */
+	struct Emulation emu;
+	emu.c8 = c8;
+	emu.frames = triple_buffer_create(sizeof(struct Frame));
+	emu.input = spsc_queue_create(sizeof(struct Input_event), INPUT_QUEUE_SZ);
+	atomic_init(&emu.late_wake, 0.0);
+	atomic_init(&emu.running, true);
+	Thread emu_thread = thread_create(emulation_thread, &emu);
 
+	struct Input_event unsent = { INPUT_NONE };
+	bool sent_rewind = false;
+	struct Frame shown = { { 0 } };
+	unsigned char gfx[CHIP8_DISPLAY_WIDTH * CHIP8_DISPLAY_HEIGHT] = { 0 };
+	uint64_t dirty_rows = GFXSCREEN_ALL_ROWS;
 	while (!GFXscreen_window_close(gfxs)) {
 		GFXscreen_process_input(gfxs);
-		chip8_execute_opcode(c8, GFXscreen_get_keypad_state_map(gfxs));
-		GFXscreen_draw_frame(gfxs, chip8_get_gfx(c8));
+		send_input(emu.input, gfxs, &unsent, &sent_rewind);
+
+		bool fresh;
+		const struct Frame *frame = triple_buffer_read(emu.frames, &fresh);
+		if (fresh) {
+			dirty_rows |= expand_frame(frame, &shown, gfx);
+			if (frame->input_time != 0.0)
+				GFXscreen_mark_input(gfxs, frame->input_time);
+		}
+		GFXscreen_draw_frame(gfxs, gfx, dirty_rows);
+		dirty_rows = 0;
+		atomic_store(&emu.late_wake, GFXscreen_get_late_wake(gfxs));
 	}
 
-	GFXscreen_destroy(gfxs);
-	chip8_destroy(c8);
+	atomic_store(&emu.running, false);
+	thread_join(emu_thread);
+	spsc_queue_destroy(emu.input);
+	triple_buffer_destroy(emu.frames);
+	GFXscreen_hide(gfxs);
+	return GFXscreen_get_latency(gfxs);
 }
 
-void default_keypad_keyboard_mapping(GFXscreen gfxs)
+/*
+ * owns the Chip8 until running is cleared, paced at DISPLAY_HZ on its own so
+ * swaps and driver stalls on the window thread never hold the guest back
+ */
+void emulation_thread(void *arg)
+{
+	struct Emulation *emu = (struct Emulation*)arg;
+
+	// held keys and the keys pressed since the guest last saw them
+	uint16_t keys = 0;
+	uint16_t pressed = 0;
+	bool rewind_held = false;
+
+	Scheduler sched = scheduler_create(INSTRUCTIONS_PER_SECOND, DISPLAY_HZ);
+	Pacer pacer = pacer_create(DISPLAY_HZ);
+	Rewind rw = rewind_create(REWIND_BUFFER_SZ);
+	while (atomic_load(&emu->running)) {
+		double input_time = 0.0;
+		struct Input_event event;
+		while (spsc_queue_pop(emu->input, &event)) {
+			if (event.type == INPUT_REWIND) {
+				rewind_held = event.pressed;
+				continue;
+			}
+			if (input_time == 0.0)
+				input_time = event.time;
+			if (event.pressed) {
+				keys |= 1u << event.key;
+				pressed |= 1u << event.key;
+			}
+			else
+				keys &= ~(1u << event.key);
+		}
+
+		scheduler_advance(sched);
+		if (rewind_held) {
+			// guest time stands still while stepping back
+			scheduler_take_cycles(sched);
+			rewind_step_back(rw, emu->c8);
+			pressed = 0;
+		}
+		else {
+			run_frame(emu->c8, sched, keys, &pressed);
+			pressed = 0;
+			rewind_capture(rw, emu->c8);
+		}
+
+		struct Frame *frame = triple_buffer_write_slot(emu->frames);
+		memcpy(frame->rows, chip8_get_gfx_rows(emu->c8), sizeof(frame->rows));
+		frame->input_time = input_time;
+		triple_buffer_publish(emu->frames);
+
+		// only the step time is measured, nothing is presented here
+		double published = get_time();
+		pacer_present(pacer, published, published);
+		/*
+		 * the window wakes just before vblank to sample input and draw, steps
+		 * are shifted to finish right before that so it shows the newest one
+		 */
+		double late_wake = atomic_load(&emu->late_wake);
+		if (late_wake != 0.0)
+			pacer_align_finish(pacer, late_wake);
+		pacer_wait(pacer);
+	}
+
+	rewind_destroy(rw);
+	pacer_destroy(pacer);
+	scheduler_destroy(sched);
+}
+
+// run the cycles the scheduler owes for this frame, fx0a may consume presses
+void run_frame(Chip8 c8, Scheduler sched, uint16_t keys, uint16_t *pressed)
+{
+	do {
+		unsigned long budget = scheduler_take_cycles(sched);
+		while (budget) {
+			unsigned long long start = chip8_get_cycles(c8);
+			Chip8_stop stop = chip8_run_cycles(c8, budget, keys, pressed);
+			if (stop == CHIP8_STOP_BLOCKED)
+				return;
+			budget -= (unsigned long)(chip8_get_cycles(c8) - start);
+		}
+	} while (scheduler_uncapped(sched) && !scheduler_frame_due(sched));
+}
+
+/*
+ * forwards keypad events in order and rewind changes, an event the queue has
+ * no room for is kept in unsent and retried first next frame
+ */
+void send_input(Spsc_queue input, GFXscreen gfxs,
+	struct Input_event *unsent, bool *sent_rewind)
+{
+	GFXscreen_key_event key_event;
+	for (;;) {
+		if (unsent->type == INPUT_NONE) {
+			if (!GFXscreen_next_key_event(gfxs, &key_event))
+				break;
+			unsent->type = INPUT_KEYPAD;
+			unsent->key = key_event.keypad;
+			unsent->pressed = key_event.pressed;
+			unsent->time = key_event.time;
+		}
+		if (!spsc_queue_push(input, unsent))
+			break;
+		unsent->type = INPUT_NONE;
+	}
+
+	struct Input_event event;
+	bool rewind_held = GFXscreen_rewind_held(gfxs);
+	if (rewind_held != *sent_rewind) {
+		event.type = INPUT_REWIND;
+		event.key = 0;
+		event.pressed = rewind_held;
+		event.time = 0.0;
+		if (spsc_queue_push(input, &event))
+			*sent_rewind = rewind_held;
+	}
+}
+
+/*
+ * expands the rows of frame that differ from shown into gfx bytes, returns
+ * them as a dirty row mask, skipped frames are covered since rows are
+ * compared against what was last expanded rather than the previous frame
+ */
+uint64_t expand_frame(const struct Frame *frame, struct Frame *shown,
+	unsigned char gfx[])
+{
+	uint64_t dirty_rows = 0;
+	for (size_t row = 0; row < CHIP8_DISPLAY_HEIGHT; ++row) {
+		uint64_t bits = frame->rows[row];
+		if (bits == shown->rows[row])
+			continue;
+
+		unsigned char *pixel = gfx + row * CHIP8_DISPLAY_WIDTH;
+		for (size_t col = 0; col < CHIP8_DISPLAY_WIDTH; ++col)
+			pixel[col] = bits >> (CHIP8_DISPLAY_WIDTH - 1 - col) & 1;
+		shown->rows[row] = bits;
+		dirty_rows |= (uint64_t)1 << row;
+	}
+	return dirty_rows;
+}
+
+void print_keybindings(void)
 {
     printf("default keybindings\n");
     printf("Keypad		Keyboard\n");
@@ -116,7 +405,11 @@ void default_keypad_keyboard_mapping(GFXscreen gfxs)
     printf("+-+-+-+-+	+-+-+-+-+\n");
     printf("|A|0|B|F|	|Z|X|C|V|\n");
     printf("+-+-+-+-+	+-+-+-+-+\n");
+    printf("hold BACKSPACE to rewind\n");
+}
 
+void default_keypad_keyboard_mapping(GFXscreen gfxs)
+{
 	GFXscreen_map_keypad_keyboard(gfxs, 0, 'X');
 	GFXscreen_map_keypad_keyboard(gfxs, 1, '1');
 	GFXscreen_map_keypad_keyboard(gfxs, 2, '2');
@@ -0,0 +1,230 @@
+#include "Rewind.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../utility/utility.h"
+
+
+#define FNAME "Rewind.c"
+
+// bytes framing every entry, its length before and after the payload
+#define ENTRY_FRAME_SZ 8
+// zero bytes needed to end a literal run, shorter gaps stay literal
+#define MIN_ZERO_RUN 4
+#define MAX_RUN 0xFFFF
+
+
+static unsigned char* encode_delta(Rewind rw, size_t *sz);
+static void apply_delta(Rewind rw, const unsigned char *delta, size_t sz);
+static void push_entry(Rewind rw, const unsigned char *entry, size_t sz);
+static void drop_oldest(Rewind rw);
+static void ring_write(Rewind rw, size_t pos, const void *src, size_t n);
+static void ring_read(Rewind rw, size_t pos, void *dst, size_t n);
+
+
+/*
+ * checkpoints are chained backwards from the newest one: the ring holds, for
+ * every checkpoint, the XOR of it with the one before, run length encoded,
+ * so stepping back xors the newest delta into latest and pops it
+ */
+struct Rewind_t {
+	size_t snapshot_sz;
+	bool has_latest;
+	unsigned char *latest;
+	unsigned char *current;
+	unsigned char *delta;
+	unsigned char *ring;
+	size_t capacity;
+	size_t head;
+	size_t used;
+	size_t count;
+};
+
+
+Rewind rewind_create(size_t capacity)
+{
+	Rewind rw = (Rewind)malloc(sizeof(struct Rewind_t));
+	if (!rw)
+		exit_log(FNAME, 1, "Failed creating Rewind, memory allocation fail.");
+
+	rw->snapshot_sz = chip8_snapshot_size();
+	rw->latest = (unsigned char*)malloc(rw->snapshot_sz);
+	rw->current = (unsigned char*)malloc(rw->snapshot_sz);
+	// worst case is one literal run per byte and its two run lengths
+	rw->delta = (unsigned char*)malloc(rw->snapshot_sz * 2 + 4);
+	rw->ring = (unsigned char*)malloc(capacity);
+	if (!rw->latest || !rw->current || !rw->delta || !rw->ring)
+		exit_log(FNAME, 1, "Failed creating Rewind, memory allocation fail.");
+
+	rw->capacity = capacity;
+	rewind_clear(rw);
+	return rw;
+}
+
+// checkpoint c8, meant to be called once per frame
+void rewind_capture(Rewind rw, const Chip8 c8)
+{
+	if (!rw->has_latest) {
+		chip8_snapshot(c8, rw->latest);
+		rw->has_latest = true;
+		return;
+	}
+
+	chip8_snapshot(c8, rw->current);
+	size_t sz;
+	unsigned char *delta = encode_delta(rw, &sz);
+	push_entry(rw, delta, sz);
+
+	unsigned char *tmp = rw->latest;
+	rw->latest = rw->current;
+	rw->current = tmp;
+}
+
+// restore the checkpoint before the newest one, false when none is left
+bool rewind_step_back(Rewind rw, Chip8 c8)
+{
+	if (!rw->count)
+		return false;
+
+	uint32_t sz;
+	ring_read(rw, (rw->head + rw->capacity - 4) % rw->capacity, &sz, 4);
+	size_t start = (rw->head + rw->capacity - sz - ENTRY_FRAME_SZ)
+		% rw->capacity;
+	ring_read(rw, (start + 4) % rw->capacity, rw->delta, sz);
+
+	rw->head = start;
+	rw->used -= sz + ENTRY_FRAME_SZ;
+	--rw->count;
+
+	apply_delta(rw, rw->delta, sz);
+	chip8_restore(c8, rw->latest, rw->snapshot_sz);
+	return true;
+}
+
+size_t rewind_get_count(Rewind rw)
+{
+	return rw->count;
+}
+
+void rewind_clear(Rewind rw)
+{
+	rw->has_latest = false;
+	rw->head = 0;
+	rw->used = 0;
+	rw->count = 0;
+}
+
+void rewind_destroy(Rewind rw)
+{
+	free(rw->ring);
+	free(rw->delta);
+	free(rw->current);
+	free(rw->latest);
+	free(rw);
+}
+
+/*
+ * XOR of current against latest as (zero run, literal run, literals)
+ * records, run lengths are 16 bit little endian
+ */
+static unsigned char* encode_delta(Rewind rw, size_t *sz)
+{
+	const unsigned char *a = rw->latest;
+	const unsigned char *b = rw->current;
+	size_t n = rw->snapshot_sz;
+	unsigned char *out = rw->delta;
+
+	size_t i = 0;
+	while (i < n) {
+		size_t zeros = 0;
+		while (i < n && zeros < MAX_RUN && a[i] == b[i]) {
+			++zeros;
+			++i;
+		}
+
+		size_t literal_start = i;
+		while (i < n && i - literal_start < MAX_RUN) {
+			size_t gap = 0;
+			while (i + gap < n && gap < MIN_ZERO_RUN && a[i + gap] == b[i + gap])
+				++gap;
+			if (gap == MIN_ZERO_RUN || i + gap == n)
+				break;
+			i += gap + 1;
+		}
+		if (i - literal_start > MAX_RUN)
+			i = literal_start + MAX_RUN;
+
+		size_t literals = i - literal_start;
+		*out++ = (unsigned char)zeros;
+		*out++ = (unsigned char)(zeros >> 8);
+		*out++ = (unsigned char)literals;
+		*out++ = (unsigned char)(literals >> 8);
+		for (size_t j = literal_start; j < i; ++j)
+			*out++ = a[j] ^ b[j];
+	}
+
+	*sz = out - rw->delta;
+	return rw->delta;
+}
+
+static void apply_delta(Rewind rw, const unsigned char *delta, size_t sz)
+{
+	const unsigned char *end = delta + sz;
+	unsigned char *iter = rw->latest;
+	while (delta < end) {
+		size_t zeros = delta[0] | delta[1] << 8;
+		size_t literals = delta[2] | delta[3] << 8;
+		delta += 4;
+		iter += zeros;
+		for (size_t i = 0; i < literals; ++i)
+			*iter++ ^= *delta++;
+	}
+}
+
+// append an entry, evicting the oldest ones until it fits
+static void push_entry(Rewind rw, const unsigned char *entry, size_t sz)
+{
+	if (sz + ENTRY_FRAME_SZ > rw->capacity) {
+		rw->head = 0;
+		rw->used = 0;
+		rw->count = 0;
+		return;
+	}
+
+	while (rw->used + sz + ENTRY_FRAME_SZ > rw->capacity)
+		drop_oldest(rw);
+
+	uint32_t len = (uint32_t)sz;
+	ring_write(rw, rw->head, &len, 4);
+	ring_write(rw, (rw->head + 4) % rw->capacity, entry, sz);
+	ring_write(rw, (rw->head + 4 + sz) % rw->capacity, &len, 4);
+
+	rw->head = (rw->head + sz + ENTRY_FRAME_SZ) % rw->capacity;
+	rw->used += sz + ENTRY_FRAME_SZ;
+	++rw->count;
+}
+
+static void drop_oldest(Rewind rw)
+{
+	size_t tail = (rw->head + rw->capacity - rw->used) % rw->capacity;
+	uint32_t sz;
+	ring_read(rw, tail, &sz, 4);
+	rw->used -= sz + ENTRY_FRAME_SZ;
+	--rw->count;
+}
+
+static void ring_write(Rewind rw, size_t pos, const void *src, size_t n)
+{
+	size_t first = n < rw->capacity - pos ? n : rw->capacity - pos;
+	memcpy(rw->ring + pos, src, first);
+	memcpy(rw->ring, (const unsigned char*)src + first, n - first);
+}
+
+static void ring_read(Rewind rw, size_t pos, void *dst, size_t n)
+{
+	size_t first = n < rw->capacity - pos ? n : rw->capacity - pos;
+	memcpy(dst, rw->ring + pos, first);
+	memcpy((unsigned char*)dst + first, rw->ring, n - first);
+}
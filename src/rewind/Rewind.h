@@ -0,0 +1,27 @@
+#ifndef REWIND_REWIND_H
+#define REWIND_REWIND_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../Chip8/Chip8.h"
+
+
+typedef struct Rewind_t* Rewind;
+
+
+Rewind rewind_create(size_t capacity);
+
+void rewind_capture(Rewind rw, const Chip8 c8);
+
+bool rewind_step_back(Rewind rw, Chip8 c8);
+
+size_t rewind_get_count(Rewind rw);
+
+void rewind_clear(Rewind rw);
+
+void rewind_destroy(Rewind rw);
+
+
+#endif
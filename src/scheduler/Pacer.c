@@ -0,0 +1,149 @@
+#include "Pacer.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "../utility/utility.h"
+
+
+#define FNAME "Pacer.c"
+// weight of the newest sample in the smoothed latency and work times
+#define SMOOTHING 0.1
+// head room kept between the end of late frame work and the vblank
+#define LATE_SAFETY 0.002
+
+
+/*
+ * deadlines are spaced exactly one period apart rather than measured from
+ * when the previous wait returned, so wakeup jitter never accumulates
+ */
+struct Pacer_t {
+	double period;
+	double deadline;
+	double wake;		// when the last wait returned
+	double input;		// oldest input the next present shows, 0 if none
+	double vblank;		// when the last present completed
+	double work;		// smoothed wake to submit time
+	double latency;		// smoothed input to present time
+};
+
+
+static double late_wake(Pacer pacer);
+
+
+Pacer pacer_create(unsigned hz)
+{
+	Pacer pacer = (Pacer)malloc(sizeof(struct Pacer_t));
+	if (!pacer)
+		exit_log(FNAME, 1, "Failed creating Pacer, memory allocation fail.");
+
+	pacer_set_hz(pacer, hz);
+	pacer->wake = pacer->deadline;
+	pacer->vblank = pacer->deadline;
+	pacer->work = 0.0;
+	return pacer;
+}
+
+// also starts the latency measurement over
+void pacer_set_hz(Pacer pacer, unsigned hz)
+{
+	pacer->period = hz == PACER_UNCAPPED ? 0.0 : 1.0 / hz;
+	pacer->deadline = get_time();
+	pacer->input = 0.0;
+	pacer->latency = 0.0;
+}
+
+// blocks until the next frame deadline, sleeping for all but its tail
+void pacer_wait(Pacer pacer)
+{
+	if (pacer->period != 0.0) {
+		pacer->deadline += pacer->period;
+		double now = get_time();
+		// more than a frame behind, drop the missed deadlines, don't burst
+		if (now - pacer->deadline > pacer->period)
+			pacer->deadline = now;
+		else
+			sleep_until(pacer->deadline);
+	}
+	pacer->wake = get_time();
+}
+
+/*
+ * for presents synchronized to vblank, blocks until the next vblank is just
+ * far enough away for the measured frame work to finish before it, so input
+ * is sampled as late as possible
+ */
+void pacer_wait_late(Pacer pacer)
+{
+	if (pacer->period != 0.0)
+		sleep_until(late_wake(pacer));
+	pacer->wake = get_time();
+}
+
+// when pacer_wait_late returns, or returned for the current frame, 0 uncapped
+double pacer_late_wake(Pacer pacer)
+{
+	return pacer->period != 0.0 ? late_wake(pacer) : 0.0;
+}
+
+/*
+ * eases the pacer_wait deadlines towards finishing the measured frame work
+ * just before time, or a whole number of periods from it, shifts are under
+ * half a period so no deadline is skipped or doubled
+ */
+void pacer_align_finish(Pacer pacer, double time)
+{
+	if (pacer->period == 0.0)
+		return;
+
+	double target = time - pacer->work - LATE_SAFETY;
+	double offset = fmod(target - pacer->deadline, pacer->period);
+	if (offset > pacer->period / 2)
+		offset -= pacer->period;
+	else if (offset < -pacer->period / 2)
+		offset += pacer->period;
+	pacer->deadline += offset * SMOOTHING;
+}
+
+// time is when the input reached the host, the oldest one of a frame is kept
+void pacer_mark_input(Pacer pacer, double time)
+{
+	if (pacer->input == 0.0 || time < pacer->input)
+		pacer->input = time;
+}
+
+// submit is when the swap was issued, presented is when it returned
+void pacer_present(Pacer pacer, double submit, double presented)
+{
+	pacer->work += (submit - pacer->wake - pacer->work) * SMOOTHING;
+	// frames that show no new input say nothing about latency
+	if (pacer->input != 0.0) {
+		double latency = presented - pacer->input;
+		// the first sample seeds the average rather than pulling it from 0
+		if (pacer->latency == 0.0)
+			pacer->latency = latency;
+		else
+			pacer->latency += (latency - pacer->latency) * SMOOTHING;
+		pacer->input = 0.0;
+	}
+	pacer->vblank = presented;
+}
+
+// smoothed seconds from an input to presenting the first frame that shows it
+double pacer_get_latency(Pacer pacer)
+{
+	return pacer->latency;
+}
+
+void pacer_destroy(Pacer pacer)
+{
+	free(pacer);
+}
+
+static double late_wake(Pacer pacer)
+{
+	double lead = pacer->work + LATE_SAFETY;
+	if (lead > pacer->period)
+		lead = pacer->period;
+	return pacer->vblank + pacer->period - lead;
+}
@@ -0,0 +1,33 @@
+#ifndef SCHEDULER_PACER_H
+#define SCHEDULER_PACER_H
+
+
+// frame rate value that never waits
+#define PACER_UNCAPPED 0
+
+
+typedef struct Pacer_t* Pacer;
+
+
+Pacer pacer_create(unsigned hz);
+
+void pacer_set_hz(Pacer pacer, unsigned hz);
+
+void pacer_wait(Pacer pacer);
+
+void pacer_wait_late(Pacer pacer);
+
+double pacer_late_wake(Pacer pacer);
+
+void pacer_align_finish(Pacer pacer, double time);
+
+void pacer_mark_input(Pacer pacer, double time);
+
+void pacer_present(Pacer pacer, double submit, double presented);
+
+double pacer_get_latency(Pacer pacer);
+
+void pacer_destroy(Pacer pacer);
+
+
+#endif
@@ -0,0 +1,90 @@
+#include "Scheduler.h"
+
+#include <stdlib.h>
+
+#include "../utility/utility.h"
+
+
+#define FNAME "Scheduler.c"
+
+// largest slice of host time credited at once, stalls beyond it are dropped
+#define MAX_FRAME_LAG 0.25
+// cycles per call while uncapped, the caller repeats until a frame is due
+#define UNCAPPED_BATCH 1024
+
+
+struct Scheduler_t {
+	unsigned ips;
+	unsigned hz;
+	double prev_time;
+	double frame_start;
+	double cycle_acc;
+};
+
+
+Scheduler scheduler_create(unsigned ips, unsigned hz)
+{
+	if (!hz)
+		exit_log(FNAME, 1, "Failed creating Scheduler, frame rate of 0.");
+
+	Scheduler sched = (Scheduler)malloc(sizeof(struct Scheduler_t));
+	if (!sched)
+		exit_log(FNAME, 1,
+			"Failed creating Scheduler, memory allocation fail.");
+
+	sched->ips = ips;
+	sched->hz = hz;
+	sched->prev_time = get_time();
+	sched->frame_start = sched->prev_time;
+	sched->cycle_acc = 0.0;
+	return sched;
+}
+
+void scheduler_set_ips(Scheduler sched, unsigned ips)
+{
+	sched->ips = ips;
+	sched->cycle_acc = 0.0;
+}
+
+bool scheduler_uncapped(Scheduler sched)
+{
+	return sched->ips == SCHEDULER_UNCAPPED;
+}
+
+// credit the host time elapsed since the previous call, once per frame
+void scheduler_advance(Scheduler sched)
+{
+	double now = get_time();
+	double elapsed = now - sched->prev_time;
+	if (elapsed > MAX_FRAME_LAG)
+		elapsed = MAX_FRAME_LAG;
+
+	sched->prev_time = now;
+	sched->frame_start = now;
+	sched->cycle_acc += elapsed;
+}
+
+/*
+ * whole cycles owed for the credited time, the fractional remainder stays in
+ * the accumulator so the average rate matches ips however frames are paced
+ */
+unsigned long scheduler_take_cycles(Scheduler sched)
+{
+	if (scheduler_uncapped(sched))
+		return UNCAPPED_BATCH;
+
+	unsigned long cycles = (unsigned long)(sched->cycle_acc * sched->ips);
+	sched->cycle_acc -= (double)cycles / sched->ips;
+	return cycles;
+}
+
+// true once a full frame period has passed since scheduler_advance
+bool scheduler_frame_due(Scheduler sched)
+{
+	return get_time() - sched->frame_start >= 1.0 / sched->hz;
+}
+
+void scheduler_destroy(Scheduler sched)
+{
+	free(sched);
+}
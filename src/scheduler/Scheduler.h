@@ -0,0 +1,30 @@
+#ifndef SCHEDULER_SCHEDULER_H
+#define SCHEDULER_SCHEDULER_H
+
+
+#include <stdbool.h>
+
+
+// instructions per second value that runs the guest as fast as possible
+#define SCHEDULER_UNCAPPED 0
+
+
+typedef struct Scheduler_t* Scheduler;
+
+
+Scheduler scheduler_create(unsigned ips, unsigned hz);
+
+void scheduler_set_ips(Scheduler sched, unsigned ips);
+
+bool scheduler_uncapped(Scheduler sched);
+
+void scheduler_advance(Scheduler sched);
+
+unsigned long scheduler_take_cycles(Scheduler sched);
+
+bool scheduler_frame_due(Scheduler sched);
+
+void scheduler_destroy(Scheduler sched);
+
+
+#endif
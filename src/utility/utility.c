@@ -1,11 +1,31 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "utility.h"
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <errno.h>
+	#include <time.h>
+#endif
 
 
 #define FNAME "utility.c"
+// tail of a sleep_until spun rather than slept, covers OS wakeup latency
+#define SPIN_WINDOW 0.001
+// maps up to this many entries live inside the struct, no allocations
+#define MAP_SMALL_SZ 16
+#define MAP_NOT_FOUND -1
+// every arena allocation is aligned for any scalar or SIMD type
+#define ARENA_ALIGN 16
 
 
 void exit_log(const char *file_name, int msg_count, ...)
@@ -21,74 +41,223 @@ void exit_log(const char *file_name, int msg_count, ...)
 	exit(1);
 }
 
+// seconds on a monotonic clock, only differences between calls are meaningful
+double get_time(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / freq.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+/*
+ * sleeps until get_time() reaches deadline, the OS sleep ends SPIN_WINDOW
+ * early and the remainder is spun, elsewhere than linux the sleep is relative
+ */
+void sleep_until(double deadline)
+{
+	double sleep_end = deadline - SPIN_WINDOW;
+	double now = get_time();
+
+	if (sleep_end > now) {
+#if defined(_WIN32)
+		Sleep((DWORD)((sleep_end - now) * 1000));
+#elif defined(__APPLE__)
+		struct timespec rel;
+		rel.tv_sec = (time_t)(sleep_end - now);
+		rel.tv_nsec = (long)((sleep_end - now - rel.tv_sec) * 1e9);
+		nanosleep(&rel, NULL);
+#else
+		// absolute deadline on the clock get_time reads, immune to drift
+		struct timespec abs;
+		abs.tv_sec = (time_t)sleep_end;
+		abs.tv_nsec = (long)((sleep_end - abs.tv_sec) * 1e9);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abs, NULL)
+			== EINTR)
+			;
+#endif
+	}
+
+	while (get_time() < deadline)
+		;
+}
+
+
+/*
+ * one block sized up front and handed out by bumping an offset, the header
+ * sits at the start of the block so teardown is a single free
+ */
+struct Arena_t {
+	size_t capacity;
+	size_t used;
+	unsigned char *memory;
+};
+
+// sz rounded up to the alignment arena_alloc keeps
+size_t arena_size(size_t sz)
+{
+	return (sz + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+Arena arena_create(size_t capacity)
+{
+	size_t header_sz = arena_size(sizeof(struct Arena_t));
+	Arena arena = (Arena)malloc(header_sz + capacity);
+	if (!arena)
+		exit_log(FNAME, 1, "Failed to create arena, memory allocation fail.");
+
+	arena->capacity = capacity;
+	arena->used = 0;
+	arena->memory = (unsigned char*)arena + header_sz;
+	return arena;
+}
+
+// uninitialized, running out means the up front size was computed wrong
+void* arena_alloc(Arena arena, size_t sz)
+{
+	sz = arena_size(sz);
+	if (sz > arena->capacity - arena->used)
+		exit_log(FNAME, 1, "Failed to allocate from arena, arena exhausted.");
+
+	void *ptr = arena->memory + arena->used;
+	arena->used += sz;
+	return ptr;
+}
+
+// every allocation made so far is released at once
+void arena_reset(Arena arena)
+{
+	arena->used = 0;
+}
+
+void arena_destroy(Arena arena)
+{
+	free(arena);
+}
+
 
+/*
+ * entries are kept in insertion order in keys and values, lookups go through
+ * one of three indexes:
+ *	direct - while every key is in [0, MAP_SMALL_SZ), the key is the index
+ *	scan   - otherwise while size <= MAP_SMALL_SZ, a scan of the inline arrays
+ *	slots  - past that, an open addressing (linear probing) table holding
+ *	         entry index + 1 with 0 for an empty slot, at most half full
+ */
 struct Map_t {
 	size_t size;
+	size_t capacity;
 	int *keys;
 	int *values;
+	bool direct;
+	signed char direct_index[MAP_SMALL_SZ];
+	size_t *slots;
+	size_t slots_mask;
+	int small_keys[MAP_SMALL_SZ];
+	int small_values[MAP_SMALL_SZ];
 };
 
+
+static long map_find(Map map, int key);
+static size_t map_hash(const Map map, int key);
+static void map_grow(Map map);
+static void map_rehash(Map map, size_t slots_sz);
+
+
 Map map_create(size_t size, ...)
 {
 	Map map = (Map)malloc(sizeof(struct Map_t));
 	if (!map)
 		exit_log(FNAME, 1, "Failed to create map, memory allocation fail.");
 
-	map->size = size / 2;
-
-	map->keys = (int*)malloc(sizeof(int) * map->size);
-	if(!map->keys)
-		exit_log(FNAME, 1, "Failed to create map, memory allocation fail.");
-	map->values = (int*)malloc(sizeof(int) * map->size);
-	if(!map->values)
-		exit_log(FNAME, 1, "Failed to create map, memory allocation fail.");
+	map->size = 0;
+	map->capacity = MAP_SMALL_SZ;
+	map->keys = map->small_keys;
+	map->values = map->small_values;
+	map->direct = true;
+	memset(map->direct_index, MAP_NOT_FOUND, sizeof(map->direct_index));
+	map->slots = NULL;
+	map->slots_mask = 0;
 
+	// size counts the variadic arguments, a key and a value per entry
 	va_list ap;
 	va_start(ap, size);
-	for (size_t i = 0; i < map->size; ++i) {
-		map->keys[i] = va_arg(ap, int);
-		map->values[i] = va_arg(ap, int);
+	for (size_t i = 0; i < size / 2; ++i) {
+		int key = va_arg(ap, int);
+		int value = va_arg(ap, int);
+		map_add(map, key, value);
 	}
 	va_end(ap);
 
 	return map;
 }
 
+// adding a key that is already present overwrites its value
 void map_add(Map map, int key, int value)
 {
-	int *keys_tmp = (int*)malloc(sizeof(int) * (map->size + 1));
-	if (!keys_tmp)
-		exit_log(FNAME, 1, "Failed to add to map, memory allocation fail.");
-	int *values_tmp = (int*)malloc(sizeof(int) * (map->size + 1));
-	if (!values_tmp)
-		exit_log(FNAME, 1, "Failed to add to map, memory allocation fail.");
-
-	for (size_t i = 0; i < map->size; ++i) {
-		keys_tmp[i] = map->keys[i];
-		values_tmp[i] = map->values[i];
+	long found = map_find(map, key);
+	if (found != MAP_NOT_FOUND) {
+		map->values[found] = value;
+		return ;
 	}
-	keys_tmp[map->size] = key;
-	values_tmp[map->size] = value;
-	++map->size;
 
-	free(map->keys);
-	free(map->values);
+	if (map->size == map->capacity)
+		map_grow(map);
+	size_t index = map->size++;
+	map->keys[index] = key;
+	map->values[index] = value;
 
-	map->keys = keys_tmp;
-	map->values = values_tmp;
+	if (map->direct && key >= 0 && key < MAP_SMALL_SZ) {
+		map->direct_index[key] = (signed char)index;
+		return ;
+	}
+	map->direct = false;
+
+	if (map->slots) {
+		// rehash before passing half full, probes stay short
+		if (map->size * 2 > map->slots_mask + 1)
+			map_rehash(map, (map->slots_mask + 1) * 2);
+		else {
+			size_t slot = map_hash(map, key);
+			while (map->slots[slot])
+				slot = (slot + 1) & map->slots_mask;
+			map->slots[slot] = index + 1;
+		}
+	}
+	else if (map->size > MAP_SMALL_SZ)
+		map_rehash(map, MAP_SMALL_SZ * 4);
 }
 
 int map_get(Map map, int key)
 {
-	for (size_t i = 0; i < map->size; ++i)
-		if (map->keys[i] == key)
-			return map->values[i];
+	int value;
+	if (map_try_get(map, key, &value))
+		return value;
 
 	char key_str[32];
 	sprintf(key_str, "\tkey: %d", key);
 	exit_log(FNAME, 2, "Failed to get value in map, key not found.", key_str);
 }
 
+// non fatal map_get, value is left untouched when key isn't present
+bool map_try_get(Map map, int key, int *value)
+{
+	long found = map_find(map, key);
+	if (found == MAP_NOT_FOUND)
+		return false;
+
+	*value = map->values[found];
+	return true;
+}
+
 const int* map_get_keys(Map map)
 {
 	return map->keys;
@@ -106,11 +275,11 @@ size_t map_get_size(Map map)
 
 void map_set(Map map, int key, int value)
 {
-	for (size_t i = 0; i < map->size; ++i)
-		if (map->keys[i] == key) {
-			map->values[i] = value;
-			return ;
-		}
+	long found = map_find(map, key);
+	if (found != MAP_NOT_FOUND) {
+		map->values[found] = value;
+		return ;
+	}
 
 	char key_str[32];
 	sprintf(key_str, "\tkey: %d", key);
@@ -119,7 +288,81 @@ void map_set(Map map, int key, int value)
 
 void map_destroy(Map map)
 {
-	free(map->keys);
-	free(map->values);
+	if (map->keys != map->small_keys) {
+		free(map->keys);
+		free(map->values);
+	}
+	free(map->slots);
 	free(map);
 }
+
+// index of key in keys and values, MAP_NOT_FOUND if absent
+static long map_find(Map map, int key)
+{
+	if (map->direct)
+		return key >= 0 && key < MAP_SMALL_SZ
+			? map->direct_index[key] : MAP_NOT_FOUND;
+
+	if (!map->slots) {
+		for (size_t i = 0; i < map->size; ++i)
+			if (map->keys[i] == key)
+				return (long)i;
+		return MAP_NOT_FOUND;
+	}
+
+	for (size_t slot = map_hash(map, key); map->slots[slot];
+		slot = (slot + 1) & map->slots_mask)
+		if (map->keys[map->slots[slot] - 1] == key)
+			return (long)(map->slots[slot] - 1);
+	return MAP_NOT_FOUND;
+}
+
+// fibonacci hashing, the better mixed high half is folded into the masked bits
+static size_t map_hash(const Map map, int key)
+{
+	uint32_t hash = (uint32_t)key * 0x9E3779B9u;
+	return (hash ^ hash >> 16) & map->slots_mask;
+}
+
+// doubles the entry arrays, leaving the inline ones on the first growth
+static void map_grow(Map map)
+{
+	size_t capacity = map->capacity * 2;
+	int *keys;
+	int *values;
+	if (map->keys == map->small_keys) {
+		keys = (int*)malloc(sizeof(int) * capacity);
+		values = (int*)malloc(sizeof(int) * capacity);
+		if (keys && values) {
+			memcpy(keys, map->small_keys, sizeof(map->small_keys));
+			memcpy(values, map->small_values, sizeof(map->small_values));
+		}
+	}
+	else {
+		keys = (int*)realloc(map->keys, sizeof(int) * capacity);
+		values = (int*)realloc(map->values, sizeof(int) * capacity);
+	}
+	if (!keys || !values)
+		exit_log(FNAME, 1, "Failed to add to map, memory allocation fail.");
+
+	map->keys = keys;
+	map->values = values;
+	map->capacity = capacity;
+}
+
+// slots_sz must be a power of two larger than twice the size
+static void map_rehash(Map map, size_t slots_sz)
+{
+	free(map->slots);
+	map->slots = (size_t*)calloc(slots_sz, sizeof(size_t));
+	if (!map->slots)
+		exit_log(FNAME, 1, "Failed to add to map, memory allocation fail.");
+	map->slots_mask = slots_sz - 1;
+
+	for (size_t i = 0; i < map->size; ++i) {
+		size_t slot = map_hash(map, map->keys[i]);
+		while (map->slots[slot])
+			slot = (slot + 1) & map->slots_mask;
+		map->slots[slot] = i + 1;
+	}
+}
@@ -2,11 +2,30 @@
 #define UTILITY_H
 
 
+#include <stdbool.h>
 #include <stddef.h>
 
 
 void exit_log(const char *file_name, int msg_count, ...);
 
+double get_time(void);
+
+void sleep_until(double deadline);
+
+
+typedef struct Arena_t* Arena;
+
+// sizes passed to arena_create should be sums of arena_size of each request
+size_t arena_size(size_t sz);
+
+Arena arena_create(size_t capacity);
+
+void* arena_alloc(Arena arena, size_t sz);
+
+void arena_reset(Arena arena);
+
+void arena_destroy(Arena arena);
+
 
 typedef struct Map_t* Map;
 
@@ -16,6 +35,8 @@ void map_add(Map map, int key, int value);
 
 int map_get(Map map, int key);
 
+bool map_try_get(Map map, int key, int *value);
+
 const int* map_get_keys(Map map);
 
 const int* map_get_values(Map map);